@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Append-only spool file for large recorded HTTP bodies.
+// Bodies moved here don't stay in memory: the page cache holds them once for every connection,
+// and on Linux they're sent with sendfile() so the bytes are never copied to user space.
+class BodyStore
+{
+public:
+    struct Ref
+    {
+        uint64_t offset = 0;
+        uint64_t size = 0;
+    };
+
+    // The file is created (or truncated). A temporary one is removed with the store,
+    // i.e. when the last catalog that serves from it is gone.
+    explicit BodyStore(std::filesystem::path path, bool isTemporary = false) :
+        m_path(std::move(path)),
+        m_out(m_path, std::ios::binary | std::ios::trunc),
+        m_isTemporary(isTemporary)
+    {
+        if (!m_out.is_open())
+            throw std::runtime_error("Can't create body store: " + m_path.string());
+    }
+
+    ~BodyStore() {
+#ifdef __linux__
+        if (m_fd >= 0)
+            ::close(m_fd);
+#endif
+        if (m_isTemporary) {
+            m_out.close();
+            std::error_code ec;
+            std::filesystem::remove(m_path, ec);
+        }
+    }
+
+    BodyStore(const BodyStore&) = delete;
+    BodyStore& operator=(const BodyStore&) = delete;
+
+    // Throws if the body can't be written (e.g. the disk is full): later refs would point past the data
+    Ref append(std::string_view body) {
+        Ref ref{ m_size, body.size() };
+        m_out.write(body.data(), static_cast<std::streamsize>(body.size()));
+        if (!m_out.good())
+            throw std::runtime_error("Can't write body store: " + m_path.string());
+        m_size += body.size();
+        return ref;
+    }
+
+    // Must be called after the last append() and before the store is read
+    void seal() {
+        m_out.close();
+        if (m_out.fail())
+            throw std::runtime_error("Can't write body store: " + m_path.string());
+#ifdef __linux__
+        m_fd = ::open(m_path.c_str(), O_RDONLY);
+        if (m_fd < 0)
+            throw std::runtime_error("Can't open body store: " + m_path.string());
+#else
+        m_in.open(m_path, std::ios::binary);
+        if (!m_in.is_open())
+            throw std::runtime_error("Can't open body store: " + m_path.string());
+#endif
+    }
+
+    // Reads up to out.size() bytes from `offset`, returns how many were read (0 past the end or on an error).
+    // Any thread can read, they all share the handle opened by seal().
+    size_t read(uint64_t offset, std::span<char> out) const {
+#ifdef __linux__
+        auto size = ::pread(m_fd, out.data(), out.size(), static_cast<off_t>(offset));
+        return size < 0 ? 0 : static_cast<size_t>(size);
+#else
+        std::lock_guard lock(m_inMutex);
+        m_in.clear();
+        m_in.seekg(static_cast<std::streamoff>(offset));
+        m_in.read(out.data(), static_cast<std::streamsize>(out.size()));
+        return static_cast<size_t>(m_in.gcount());
+#endif
+    }
+
+    const std::filesystem::path& path() const {
+        return m_path;
+    }
+
+#ifdef __linux__
+    // Read-only descriptor, shared by all threads: it's only used with explicit offsets (sendfile/pread)
+    int fd() const {
+        return m_fd;
+    }
+#endif
+
+    uint64_t size() const {
+        return m_size;
+    }
+
+private:
+    std::filesystem::path m_path;
+    std::ofstream m_out;
+    bool m_isTemporary = false;
+    uint64_t m_size = 0;
+#ifdef __linux__
+    int m_fd = -1;
+#else
+    // the read position is shared, so reads take turns
+    mutable std::ifstream m_in;
+    mutable std::mutex m_inMutex;
+#endif
+};
@@ -0,0 +1,362 @@
+#pragma once
+
+#include "ReassemblyHelper.h"
+#include "Utility.h"
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+// Replay bundle: the finalized catalogs of a capture in one file, so a restart maps it
+// instead of parsing the pcap again. Offsets are from the start of the file, so it works at any address.
+// The recorded packet bytes and the HTTP bodies are served straight from the mapping. The RTSP steps,
+// the packet and keyframe indexes are copied out with one memcpy each; of the HTTP exchanges only the requests
+// (for the fingerprint index) and the heads are copied, responses are stored rendered and aren't parsed again.
+//
+// Layout, native byte order, every field 8-byte aligned:
+//   Header
+//   HTTP exchange * httpCount:  raw request, status code, recorded head, rendered head (HttpResponse::prepare), body
+//   RTSP stream * streamCount:  uri, step count, steps (method, url, header count, headers, response),
+//                               packet bytes, packet count, PacketStore::Packet[], keyframe count, uint32_t[]
+// A string is its 64-bit length and the bytes, padded to 8.
+namespace bundle {
+
+constexpr std::array<char, 8> MAGIC = { 'P', 'C', 'A', 'P', 'R', 'P', 'L', 'Y' };
+// bumped on every change of the layout or of what the stored catalogs guarantee
+// (2: packets in arrival order, 3: rendered HTTP responses)
+constexpr uint32_t VERSION = 3;
+
+// Identity of the source capture: size, modification time and a hash of chunks spread over the file,
+// so checking it doesn't read a multi-gigabyte pcap. util::hash64 isn't stable across versions:
+// if it changes, bundles look stale and are rebuilt.
+struct SourceId
+{
+    uint64_t size = 0;
+    int64_t modified = 0;
+    uint64_t hash = 0;
+
+    static std::optional<SourceId> of(const std::filesystem::path& path) {
+        constexpr uint64_t CHUNKS = 16;
+        constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+        std::error_code ec;
+        SourceId id;
+        id.size = std::filesystem::file_size(path, ec);
+        if (ec)
+            return {};
+        id.modified = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+        if (ec)
+            return {};
+
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open())
+            return {};
+        std::string chunk(CHUNK_SIZE, '\0');
+        for (uint64_t i = 0; i < CHUNKS; ++i) {
+            const uint64_t offset = id.size > CHUNK_SIZE ? (id.size - CHUNK_SIZE) / (CHUNKS - 1) * i : 0;
+            file.seekg(static_cast<std::streamoff>(offset));
+            file.read(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+            id.hash = util::hash64({ chunk.data(), static_cast<size_t>(file.gcount()) }, id.hash);
+            file.clear();
+        }
+        return id;
+    }
+
+    bool operator==(const SourceId&) const = default;
+};
+
+struct Header
+{
+    std::array<char, 8> magic = MAGIC;
+    uint32_t version = VERSION;
+    // the packet index is stored as it's laid out in memory
+    uint32_t packetSize = sizeof(PacketStore::Packet);
+    SourceId source;
+    uint64_t httpCount = 0;
+    uint64_t streamCount = 0;
+};
+
+struct Catalogs
+{
+    req_res_holder_SP_t httpRequests;
+    rtsp_stream_map_SP_t rtspStreams;
+};
+
+namespace detail {
+
+class Writer
+{
+public:
+    explicit Writer(const std::filesystem::path& path) :
+        m_out(path, std::ios::binary | std::ios::trunc)
+    {}
+
+    bool isOpen() const {
+        return m_out.is_open();
+    }
+
+    bool isGood() const {
+        return m_out.good();
+    }
+
+    template<typename T>
+    void put(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        bytes({ reinterpret_cast<const char*>(&value), sizeof(value) });
+    }
+
+    void string(std::string_view value) {
+        put<uint64_t>(value.size());
+        bytes(value);
+    }
+
+    template<typename T>
+    void array(const std::vector<T>& values) {
+        put<uint64_t>(values.size());
+        bytes({ reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T) });
+    }
+
+    // A body of the body store, written as a string; it's copied in chunks, not read into memory
+    void stored(const BodyStore& store, BodyStore::Ref body) {
+        std::array<char, 64 * 1024> chunk;
+        put<uint64_t>(body.size);
+        for (uint64_t done = 0; done < body.size;) {
+            const auto read = store.read(body.offset + done, { chunk.data(), static_cast<size_t>(std::min<uint64_t>(body.size - done, chunk.size())) });
+            if (read == 0) {
+                m_out.setstate(std::ios::failbit);
+                return;
+            }
+            m_out.write(chunk.data(), static_cast<std::streamsize>(read));
+            done += read;
+        }
+        pad(body.size);
+    }
+
+private:
+    void bytes(std::string_view data) {
+        m_out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        pad(data.size());
+    }
+
+    void pad(uint64_t size) {
+        static constexpr char PADDING[8] = {};
+        m_out.write(PADDING, static_cast<std::streamsize>((8 - size % 8) % 8));
+    }
+
+    std::ofstream m_out;
+};
+
+// Bounds-checked cursor over the mapping; a read past the end fails the reader and returns empty values
+class Reader
+{
+public:
+    explicit Reader(std::string_view data) :
+        m_data(data)
+    {}
+
+    bool isGood() const {
+        return m_isGood;
+    }
+
+    template<typename T>
+    T get() {
+        T value{};
+        auto raw = bytes(sizeof(T));
+        if (m_isGood)
+            std::memcpy(&value, raw.data(), sizeof(T));
+        return value;
+    }
+
+    std::string_view string() {
+        return bytes(get<uint64_t>());
+    }
+
+    template<typename T>
+    std::vector<T> array() {
+        const auto count = get<uint64_t>();
+        if (count > m_data.size() / sizeof(T)) {
+            m_isGood = false;
+            return {};
+        }
+        auto raw = bytes(count * sizeof(T));
+        std::vector<T> values(m_isGood ? count : 0);
+        if (!values.empty())
+            std::memcpy(values.data(), raw.data(), raw.size());
+        return values;
+    }
+
+private:
+    std::string_view bytes(uint64_t size) {
+        const uint64_t padded = (size + 7) / 8 * 8;
+        if (!m_isGood || padded < size || m_data.size() - m_pos < padded) {
+            m_isGood = false;
+            return {};
+        }
+        auto result = m_data.substr(m_pos, size);
+        m_pos += padded;
+        return result;
+    }
+
+    std::string_view m_data;
+    size_t m_pos = 0;
+    bool m_isGood = true;
+};
+
+struct Mapping
+{
+    boost::interprocess::file_mapping file;
+    boost::interprocess::mapped_region region;
+
+    std::string_view bytes() const {
+        return { static_cast<const char*>(region.get_address()), region.get_size() };
+    }
+};
+
+}
+
+// Writes the catalogs to `path` through a temporary file, so a reader never sees a half-written bundle
+inline bool write(const std::filesystem::path& path, const SourceId& source, const ReqResHolder& http, const RtspStreamCatalog& rtsp) {
+    auto temporary = path;
+    temporary += ".tmp";
+    {
+        detail::Writer out(temporary);
+        if (!out.isOpen())
+            return false;
+
+        Header header;
+        header.source = source;
+        header.httpCount = http.requests().size();
+        header.streamCount = rtsp.streams.size();
+        out.put(header);
+
+        for (auto&& reqres : http.requests()) {
+            auto& response = reqres.response;
+            out.string(reqres.request.raw());
+            out.put<uint64_t>(response.m_code);
+            out.string(*response.m_data);
+            out.string(*response.m_head);
+            // a body moved to the body store is in the bundle too, the bundle serves it without a store
+            if (response.m_storedBody && http.bodyStore())
+                out.stored(*http.bodyStore(), *response.m_storedBody);
+            else
+                out.string(response.m_body);
+        }
+
+        for (auto&& [uri, stream] : rtsp.streams) {
+            out.string(uri);
+            out.put<uint64_t>(stream.m_steps.size());
+            for (auto&& step : stream.m_steps) {
+                out.string(step.method);
+                out.string(step.m_url);
+                out.put<uint64_t>(step.headers.size());
+                for (auto&& [name, value] : step.headers) {
+                    out.string(name);
+                    out.string(value);
+                }
+                out.string(step.response());
+            }
+            out.string(stream.m_packets.bytes());
+            out.array(stream.m_packets.packets());
+            out.array(stream.m_keyframes);
+        }
+        if (!out.isGood())
+            return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temporary, path, ec);
+    return !ec;
+}
+
+// Nothing if there's no bundle at `path`, it's of another version or it was made from another capture.
+// The fingerprints of `options` are applied as if the capture was parsed. HTTP bodies are served from the mapping,
+// whatever their size, so no body store is made.
+inline std::optional<Catalogs> load(const std::filesystem::path& path, const SourceId& source, const CatalogOptions& options) {
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(path, ec) || std::filesystem::file_size(path, ec) < sizeof(Header))
+        return {};
+
+    auto mapping = std::make_shared<detail::Mapping>();
+    try {
+        mapping->file = boost::interprocess::file_mapping(path.string().c_str(), boost::interprocess::read_only);
+        mapping->region = boost::interprocess::mapped_region(mapping->file, boost::interprocess::read_only);
+    }
+    catch (const boost::interprocess::interprocess_exception&) {
+        return {};
+    }
+
+    detail::Reader in(mapping->bytes());
+    auto header = in.get<Header>();
+    if (header.magic != MAGIC || header.version != VERSION || header.packetSize != sizeof(PacketStore::Packet) || !(header.source == source))
+        return {};
+
+    // equal requests and heads keep one copy, as in makeHttpCatalog()
+    ContentStore contents;
+    http_requests_vec_t exchanges;
+    exchanges.reserve(std::min<uint64_t>(header.httpCount, mapping->bytes().size() / 16));
+    for (uint64_t i = 0; i < header.httpCount && in.isGood(); ++i) {
+        RequestResponse reqres;
+        reqres.request.append(in.string());
+        const auto code = static_cast<uint32_t>(in.get<uint64_t>());
+        auto recordedHead = contents.intern(in.string()).bytes;
+        auto head = contents.intern(in.string()).bytes;
+        reqres.response = HttpResponse::prepared(code, std::move(recordedHead), std::move(head), in.string(), mapping);
+        if (!reqres.request.parse())
+            continue;
+        reqres.request.share(contents);
+        exchanges.push_back(std::move(reqres));
+    }
+
+    auto catalog = std::make_shared<RtspStreamCatalog>();
+    for (uint64_t i = 0; i < header.streamCount && in.isGood(); ++i) {
+        RtspStream stream;
+        stream.m_uri = in.string();
+        const auto stepCount = in.get<uint64_t>();
+        for (uint64_t j = 0; j < stepCount && in.isGood(); ++j) {
+            RtspStep step;
+            step.method = in.string();
+            step.m_url = in.string();
+            const auto headerCount = in.get<uint64_t>();
+            for (uint64_t k = 0; k < headerCount && in.isGood(); ++k) {
+                auto name = in.string();
+                step.headers.emplace(name, in.string());
+            }
+            step.m_response = std::make_shared<const std::string>(in.string());
+            step.prepare();
+            stream.m_steps.push_back(std::move(step));
+        }
+        auto bytes = in.string();
+        auto packets = in.array<PacketStore::Packet>();
+        stream.m_keyframes = in.array<uint32_t>();
+
+        // a packet outside of the bytes means the file is damaged
+        const bool isInside = std::ranges::all_of(packets, [&bytes](const PacketStore::Packet& packet) {
+            return packet.offset <= bytes.size() && packet.size <= bytes.size() - packet.offset;
+        });
+        const bool isKeyframeInside = std::ranges::all_of(stream.m_keyframes, [&packets](uint32_t packet) { return packet < packets.size(); });
+        if (!isInside || !isKeyframeInside)
+            return {};
+        stream.m_packets = PacketStore::view(bytes, std::move(packets), mapping);
+        auto uri = stream.m_uri;
+        catalog->streams[uri] = std::move(stream);
+    }
+    if (!in.isGood())
+        return {};
+
+    catalog->finalize(false);
+    return Catalogs{ std::make_shared<ReqResHolder>(std::move(exchanges), options.fingerprint, nullptr, contents.stats()), std::move(catalog) };
+}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <thread>
+
+// Polls a capture file from its own thread and calls `onChange` there once a change has settled:
+// the size and modification time must stay the same for one more poll, so a capture that's
+// still being copied in isn't picked up half-way. The thread is stopped and joined on destruction.
+class CaptureWatcher
+{
+public:
+    using callback_t = std::function<void()>;
+
+    CaptureWatcher(std::filesystem::path path, std::chrono::milliseconds interval, callback_t onChange) :
+        m_path(std::move(path)),
+        m_interval(interval),
+        m_onChange(std::move(onChange)),
+        m_thread([this](std::stop_token stop) { run(stop); })
+    {}
+
+    CaptureWatcher(const CaptureWatcher&) = delete;
+    CaptureWatcher& operator=(const CaptureWatcher&) = delete;
+
+private:
+    struct Stamp
+    {
+        uintmax_t size = 0;
+        std::filesystem::file_time_type modified;
+
+        bool operator==(const Stamp&) const = default;
+    };
+
+    // nothing while the file is missing (e.g. between remove and rename)
+    std::optional<Stamp> stamp() const {
+        std::error_code ec;
+        Stamp stamp;
+        stamp.size = std::filesystem::file_size(m_path, ec);
+        if (ec)
+            return {};
+        stamp.modified = std::filesystem::last_write_time(m_path, ec);
+        if (ec)
+            return {};
+        return stamp;
+    }
+
+    void run(std::stop_token stop) {
+        std::mutex mutex;
+        std::condition_variable_any wakeUp;
+        auto loaded = stamp();
+        auto seen = loaded;
+        for (;;) {
+            {
+                // returns at once when the watcher is destroyed
+                std::unique_lock lock(mutex);
+                wakeUp.wait_for(lock, stop, m_interval, [] { return false; });
+                if (stop.stop_requested())
+                    return;
+            }
+            auto current = stamp();
+            const bool isSettled = current && current == seen;
+            seen = current;
+            if (isSettled && current != loaded) {
+                loaded = current;
+                m_onChange();
+            }
+        }
+    }
+
+    std::filesystem::path m_path;
+    std::chrono::milliseconds m_interval;
+    callback_t m_onChange;
+    // the last member: the thread starts when everything it uses is constructed
+    std::jthread m_thread;
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "Utility.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Content-addressed byte strings: equal contents are stored once and handed out as the same shared string.
+// Keys are 128-bit (two independent 64-bit hashes); a hit is compared byte by byte,
+// so a collision only costs a second copy, never a wrong answer.
+// Used while a catalog is built, the strings outlive the store.
+class ContentStore
+{
+public:
+    struct Blob
+    {
+        uint32_t id = 0;
+        std::shared_ptr<const std::string> bytes;
+    };
+
+    struct Stats
+    {
+        size_t items = 0;
+        size_t unique = 0;
+        uint64_t bytes = 0;
+        uint64_t uniqueBytes = 0;
+
+        // how many times less memory the contents take
+        double ratio() const {
+            return uniqueBytes == 0 ? 1.0 : static_cast<double>(bytes) / static_cast<double>(uniqueBytes);
+        }
+    };
+
+    Blob intern(std::string_view data) {
+        ++m_stats.items;
+        m_stats.bytes += data.size();
+
+        const Key key{ util::hash64(data, SEED_LOW), util::hash64(data, SEED_HIGH) };
+        auto [it, isNew] = m_index.try_emplace(key, static_cast<uint32_t>(m_blobs.size()));
+        if (!isNew && *m_blobs[it->second] == data)
+            return { it->second, m_blobs[it->second] };
+
+        // new, or a collision: the colliding one isn't indexed
+        const auto id = static_cast<uint32_t>(m_blobs.size());
+        m_blobs.push_back(std::make_shared<const std::string>(data));
+        ++m_stats.unique;
+        m_stats.uniqueBytes += data.size();
+        return { id, m_blobs.back() };
+    }
+
+    const std::shared_ptr<const std::string>& get(uint32_t id) const {
+        return m_blobs[id];
+    }
+
+    const Stats& stats() const {
+        return m_stats;
+    }
+
+private:
+    static constexpr uint64_t SEED_LOW = 0x243F6A8885A308D3ULL;
+    static constexpr uint64_t SEED_HIGH = 0x13198A2E03707344ULL;
+
+    struct Key
+    {
+        uint64_t low;
+        uint64_t high;
+
+        bool operator==(const Key&) const = default;
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const {
+            return static_cast<size_t>(key.low);
+        }
+    };
+
+    std::unordered_map<Key, uint32_t, KeyHash> m_index;
+    std::vector<std::shared_ptr<const std::string>> m_blobs;
+    Stats m_stats;
+};
@@ -0,0 +1,317 @@
+#pragma once
+
+#include "Raysharp.h"
+#include "Utility.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Decoded Raysharp targets and rules of every stream of a capture, indexed once,
+// so questions like "target 1234 between 10:02 and 10:05" or "rule triggers on channel 3"
+// are answered without parsing the capture again.
+// Rows stay in the columns of the decoder; the indexes are lists of row numbers sorted by arrival time.
+class DetectionStore
+{
+public:
+    enum class Kind
+    {
+        Targets,
+        Rules,
+    };
+
+    // Query string of the CLI and of the HTTP endpoint:
+    // kind=targets|rules, id=<target or rule id>, channel=N, triggered=1, from=T, to=T, limit=N.
+    // T is Unix time in seconds (fractions allowed) or UTC "2024-05-01T10:02:00[.123][Z]", the range is [from, to).
+    struct Query
+    {
+        Kind kind = Kind::Targets;
+        std::optional<uint32_t> id;
+        std::optional<uint16_t> channel;
+        // targets with a non-empty rule mask, rules that are triggered
+        bool triggeredOnly = false;
+        util::timestamp_us from = 0;
+        util::timestamp_us to = UINT64_MAX;
+        size_t limit = 1000;
+
+        // Returns nothing and sets `error` if a parameter is unknown or malformed
+        static std::optional<Query> parse(std::string_view query, std::string& error) {
+            Query result;
+            while (!query.empty()) {
+                auto amp = query.find('&');
+                auto param = query.substr(0, amp);
+                query = amp == std::string_view::npos ? std::string_view{} : query.substr(amp + 1);
+                if (param.empty())
+                    continue;
+
+                auto eq = param.find('=');
+                auto name = param.substr(0, eq);
+                auto value = eq == std::string_view::npos ? std::string_view{} : param.substr(eq + 1);
+                bool isValid = true;
+                if (name == "kind") {
+                    isValid = value == "targets" || value == "rules";
+                    result.kind = value == "rules" ? Kind::Rules : Kind::Targets;
+                }
+                else if (name == "id") {
+                    isValid = parseNumber(value, result.id.emplace());
+                }
+                else if (name == "channel") {
+                    isValid = parseNumber(value, result.channel.emplace());
+                }
+                else if (name == "triggered") {
+                    result.triggeredOnly = value != "0";
+                }
+                else if (name == "limit") {
+                    isValid = parseNumber(value, result.limit);
+                }
+                else if (name == "from" || name == "to") {
+                    auto time = parseTime(value);
+                    isValid = time.has_value();
+                    (name == "from" ? result.from : result.to) = time.value_or(0);
+                }
+                else {
+                    isValid = false;
+                }
+
+                if (!isValid) {
+                    error = fmt::format("bad query parameter '{}'", param);
+                    return {};
+                }
+            }
+            return result;
+        }
+    };
+
+    // Decodes the metadata of one more stream, must be called before finalize()
+    void add(std::string uri, const PacketStore& packets) {
+        Raysharp::decodeStream(packets, m_decoder);
+        m_uris.push_back(std::move(uri));
+        m_targetEnds.push_back(static_cast<uint32_t>(m_decoder.targets().size()));
+        m_ruleEnds.push_back(static_cast<uint32_t>(m_decoder.rules().size()));
+    }
+
+    void finalize() {
+        const auto& targets = m_decoder.targets();
+        m_targetsByTime = sortedByTime(targets.arrival);
+        m_targetsById.clear();
+        for (uint32_t row : m_targetsByTime) {
+            m_targetsById[targets.targetId[row]].push_back(row);
+        }
+
+        const auto& rules = m_decoder.rules();
+        m_rulesByTime = sortedByTime(rules.arrival);
+        m_rulesById.clear();
+        m_triggersByChannel.clear();
+        for (uint32_t row : m_rulesByTime) {
+            m_rulesById[rules.ruleId[row]].push_back(row);
+            if (rules.triggered[row])
+                m_triggersByChannel[rules.channel[row]].push_back(row);
+        }
+    }
+
+    const Raysharp::Targets& targets() const {
+        return m_decoder.targets();
+    }
+
+    const Raysharp::Rules& rules() const {
+        return m_decoder.rules();
+    }
+
+    // URI of the stream a row came from
+    std::string_view uri(Kind kind, uint32_t row) const {
+        const auto& ends = kind == Kind::Targets ? m_targetEnds : m_ruleEnds;
+        return m_uris[std::ranges::upper_bound(ends, row) - ends.begin()];
+    }
+
+    // Matching rows in arrival order, at most query.limit of them.
+    // The most selective index is scanned: the id, the triggered rules of a channel, or the time.
+    std::vector<uint32_t> find(const Query& query) const {
+        const bool isTargets = query.kind == Kind::Targets;
+        const auto& arrival = isTargets ? targets().arrival : rules().arrival;
+        const auto& channel = isTargets ? targets().channel : rules().channel;
+
+        const std::vector<uint32_t>* candidates = isTargets ? &m_targetsByTime : &m_rulesByTime;
+        if (query.id) {
+            const auto& byId = isTargets ? m_targetsById : m_rulesById;
+            auto it = byId.find(*query.id);
+            candidates = it == byId.end() ? nullptr : &it->second;
+        }
+        else if (!isTargets && query.triggeredOnly && query.channel) {
+            auto it = m_triggersByChannel.find(*query.channel);
+            candidates = it == m_triggersByChannel.end() ? nullptr : &it->second;
+        }
+
+        std::vector<uint32_t> rows;
+        if (!candidates)
+            return rows;
+
+        auto byArrival = [&arrival](uint32_t row) { return arrival[row]; };
+        auto first = std::ranges::lower_bound(*candidates, query.from, {}, byArrival);
+        auto last = std::ranges::lower_bound(first, candidates->end(), query.to, {}, byArrival);
+        for (auto it = first; it != last && rows.size() < query.limit; ++it) {
+            const uint32_t row = *it;
+            if (query.channel && channel[row] != *query.channel)
+                continue;
+            if (query.triggeredOnly && !(isTargets ? targets().ruleMask[row] != 0 : rules().triggered[row] != 0))
+                continue;
+            rows.push_back(row);
+        }
+        return rows;
+    }
+
+    void writeCsv(std::ostream& out, Kind kind, const std::vector<uint32_t>& rows) const {
+        if (kind == Kind::Targets) {
+            out << "time,stream,channel,target,rules,start_x,start_y,end_x,end_y,color\n";
+            const auto& t = targets();
+            for (uint32_t row : rows) {
+                out << fmt::format("{},{},{},{},{:#x},{},{},{},{},{}\n", formatTime(t.arrival[row]), uri(kind, row), t.channel[row], t.targetId[row],
+                    t.ruleMask[row], t.startX[row], t.startY[row], t.endX[row], t.endY[row], t.color[row]);
+            }
+            return;
+        }
+
+        out << "time,stream,channel,rule,triggered,type,trigger,points\n";
+        const auto& r = rules();
+        for (uint32_t row : rows) {
+            out << fmt::format("{},{},{},{},{},{},{},\"{}\"\n", formatTime(r.arrival[row]), uri(kind, row), r.channel[row], r.ruleId[row],
+                r.triggered[row], r.ruleType[row], r.trigType[row], points(row, ' '));
+        }
+    }
+
+    std::string toJson(Kind kind, const std::vector<uint32_t>& rows) const {
+        std::string json = fmt::format("{{\"kind\":\"{}\",\"count\":{},\"rows\":[", kind == Kind::Targets ? "targets" : "rules", rows.size());
+        for (size_t i = 0; i < rows.size(); ++i) {
+            const uint32_t row = rows[i];
+            if (i > 0)
+                json += ',';
+            if (kind == Kind::Targets) {
+                const auto& t = targets();
+                json += fmt::format("{{\"time\":\"{}\",\"stream\":\"{}\",\"channel\":{},\"target\":{},\"rules\":{},\"box\":[{},{},{},{}],\"color\":{}}}",
+                    formatTime(t.arrival[row]), jsonEscape(uri(kind, row)), t.channel[row], t.targetId[row], t.ruleMask[row],
+                    t.startX[row], t.startY[row], t.endX[row], t.endY[row], t.color[row]);
+            }
+            else {
+                const auto& r = rules();
+                json += fmt::format("{{\"time\":\"{}\",\"stream\":\"{}\",\"channel\":{},\"rule\":{},\"triggered\":{},\"type\":{},\"trigger\":{},\"points\":[{}]}}",
+                    formatTime(r.arrival[row]), jsonEscape(uri(kind, row)), r.channel[row], r.ruleId[row], r.triggered[row] ? "true" : "false",
+                    r.ruleType[row], r.trigType[row], points(row, ','));
+            }
+        }
+        json += "]}";
+        return json;
+    }
+
+    // UTC, microsecond precision: 2024-05-01T10:02:00.123456Z
+    static std::string formatTime(util::timestamp_us time) {
+        using namespace std::chrono;
+        const sys_time<microseconds> tp{ microseconds{ time } };
+        const auto day = floor<days>(tp);
+        const year_month_day date{ day };
+        const hh_mm_ss clock{ tp - day };
+        return fmt::format("{:04}-{:02}-{:02}T{:02}:{:02}:{:02}.{:06}Z", static_cast<int>(date.year()), static_cast<unsigned>(date.month()),
+            static_cast<unsigned>(date.day()), clock.hours().count(), clock.minutes().count(), clock.seconds().count(), clock.subseconds().count());
+    }
+
+    static std::optional<util::timestamp_us> parseTime(std::string_view value) {
+        using namespace std::chrono;
+        if (value.find('-') == std::string_view::npos) {
+            double seconds = 0;
+            auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), seconds);
+            if (ec != std::errc{} || end != value.data() + value.size() || seconds < 0)
+                return {};
+            return static_cast<util::timestamp_us>(seconds * 1'000'000);
+        }
+
+        // YYYY-MM-DDTHH:MM:SS[.frac][Z]
+        int y = 0;
+        unsigned mo = 0, d = 0, h = 0, mi = 0;
+        double s = 0;
+        auto take = [&value](auto& number, char separator) {
+            auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), number);
+            if (ec != std::errc{})
+                return false;
+            value.remove_prefix(end - value.data());
+            if (separator == 0)
+                return true;
+            if (value.empty() || (value.front() != separator && !(separator == 'T' && value.front() == ' ')))
+                return false;
+            value.remove_prefix(1);
+            return true;
+        };
+        if (!take(y, '-') || !take(mo, '-') || !take(d, 'T') || !take(h, ':') || !take(mi, ':') || !take(s, 0))
+            return {};
+        if (!value.empty() && value != "Z")
+            return {};
+
+        const year_month_day date{ year{ y }, month{ mo }, day{ d } };
+        if (!date.ok() || h > 23 || mi > 59 || s < 0 || s >= 61)
+            return {};
+        const auto tp = sys_days{ date } + hours{ h } + minutes{ mi };
+        return static_cast<util::timestamp_us>(duration_cast<microseconds>(tp.time_since_epoch()).count() + static_cast<int64_t>(s * 1'000'000));
+    }
+
+    static std::string jsonEscape(std::string_view value) {
+        std::string result;
+        result.reserve(value.size());
+        for (char ch : value) {
+            if (ch == '"' || ch == '\\')
+                result += '\\';
+            if (static_cast<unsigned char>(ch) < 0x20)
+                result += fmt::format("\\u{:04x}", static_cast<unsigned>(ch));
+            else
+                result += ch;
+        }
+        return result;
+    }
+
+private:
+    template<typename T>
+    static bool parseNumber(std::string_view value, T& number) {
+        auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), number);
+        return ec == std::errc{} && end == value.data() + value.size();
+    }
+
+    static std::vector<uint32_t> sortedByTime(const std::vector<util::timestamp_us>& arrival) {
+        std::vector<uint32_t> rows(arrival.size());
+        for (uint32_t i = 0; i < rows.size(); ++i)
+            rows[i] = i;
+        // streams are decoded one after another, each of them is already in arrival order
+        std::ranges::stable_sort(rows, {}, [&arrival](uint32_t row) { return arrival[row]; });
+        return rows;
+    }
+
+    // "x y,x y,..." for CSV, "[x,y],[x,y]" for JSON
+    std::string points(uint32_t row, char separator) const {
+        const auto& r = rules();
+        std::string result;
+        for (uint32_t i = 0; i < r.coordCount[row]; ++i) {
+            const auto& coord = r.coords[r.coordOffset[row] + i];
+            if (separator == ',')
+                result += fmt::format("{}[{},{}]", i > 0 ? "," : "", coord.usX, coord.usY);
+            else
+                result += fmt::format("{}{} {}", i > 0 ? "," : "", coord.usX, coord.usY);
+        }
+        return result;
+    }
+
+    Raysharp::MetadataDecoder m_decoder;
+    std::vector<std::string> m_uris;
+    // row after the last one of every stream
+    std::vector<uint32_t> m_targetEnds;
+    std::vector<uint32_t> m_ruleEnds;
+
+    std::vector<uint32_t> m_targetsByTime;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> m_targetsById;
+    std::vector<uint32_t> m_rulesByTime;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> m_rulesById;
+    std::unordered_map<uint16_t, std::vector<uint32_t>> m_triggersByChannel;
+};
@@ -0,0 +1,448 @@
+#pragma once
+
+#include "PacketStore.h"
+#include "Rtp.h"
+#include "Utility.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace h26x {
+
+enum class Codec
+{
+    H264,
+    H265,
+};
+
+// Video payload types of an SDP ("a=rtpmap:96 H264/90000", "a=rtpmap:98 H265/90000")
+inline std::unordered_map<uint8_t, Codec> sdpCodecs(std::string_view sdp) {
+    std::unordered_map<uint8_t, Codec> codecs;
+    constexpr std::string_view RTPMAP = "a=rtpmap:";
+    for (size_t pos = sdp.find(RTPMAP); pos != std::string_view::npos; pos = sdp.find(RTPMAP, pos)) {
+        pos += RTPMAP.size();
+        auto line = sdp.substr(pos, sdp.find_first_of("\r\n", pos) - pos);
+        auto space = line.find(' ');
+        if (space == std::string_view::npos)
+            continue;
+        auto encoding = line.substr(space + 1, line.find('/') - space - 1);
+        const auto pt = static_cast<uint8_t>(PatterSeekerNS::PatternSeeker(line).takeUInt64(0));
+        if (util::equalsIgnoreCase(encoding, "H264"))
+            codecs[pt] = Codec::H264;
+        else if (util::equalsIgnoreCase(encoding, "H265") || util::equalsIgnoreCase(encoding, "HEVC"))
+            codecs[pt] = Codec::H265;
+    }
+    return codecs;
+}
+
+inline uint8_t nalType(Codec codec, std::string_view nal) {
+    if (nal.empty())
+        return 0;
+    const auto b0 = static_cast<uint8_t>(nal[0]);
+    return codec == Codec::H264 ? b0 & 0x1f : (b0 >> 1) & 0x3f;
+}
+
+// IDR for H.264, IRAP (BLA/IDR/CRA) for H.265
+inline bool isKeyframe(Codec codec, uint8_t type) {
+    return codec == Codec::H264 ? type == 5 : type >= 16 && type <= 21;
+}
+
+// SPS/PPS, and VPS for H.265
+inline bool isParameterSet(Codec codec, uint8_t type) {
+    return codec == Codec::H264 ? type == 7 || type == 8 : type >= 32 && type <= 34;
+}
+
+// The packet carries the start of a keyframe NAL unit, directly or in an aggregation packet
+inline bool startsKeyframe(Codec codec, std::string_view payload) {
+    if (codec == Codec::H264) {
+        if (payload.empty())
+            return false;
+        const uint8_t type = nalType(codec, payload);
+        if (type == 28)
+            return payload.size() > 1 && (payload[1] & 0x80) && isKeyframe(codec, payload[1] & 0x1f);
+        if (type != 24)
+            return isKeyframe(codec, type);
+        payload.remove_prefix(1);
+    }
+    else {
+        if (payload.size() < 3)
+            return false;
+        const uint8_t type = nalType(codec, payload);
+        if (type == 49)
+            return (payload[2] & 0x80) && isKeyframe(codec, payload[2] & 0x3f);
+        if (type != 48)
+            return isKeyframe(codec, type);
+        payload.remove_prefix(2);
+    }
+
+    while (payload.size() > 2) {
+        const size_t size = rtp::load16(payload.data());
+        if (size == 0 || payload.size() - 2 < size)
+            return false;
+        if (isKeyframe(codec, nalType(codec, payload.substr(2, size))))
+            return true;
+        payload.remove_prefix(2 + size);
+    }
+    return false;
+}
+
+// Video elementary stream of one track: access units in decoding order.
+// NAL units are views into the PacketStore they were depacketized from;
+// only fragmented NAL units are joined, they live in `m_joined`.
+// The store must outlive the stream, the stream itself must not be copied (moving is fine).
+class ElementaryStream
+{
+public:
+    struct AccessUnit
+    {
+        uint32_t timestamp = 0;
+        util::timestamp_us arrival = 0;
+        // range in nals()
+        uint32_t firstNal = 0;
+        uint32_t nalCount = 0;
+        bool isKeyframe = false;
+        // a fragment or a packet of the unit was lost
+        bool isCorrupted = false;
+    };
+
+    explicit ElementaryStream(Codec codec) :
+        m_codec(codec)
+    {}
+
+    ElementaryStream(ElementaryStream&&) = default;
+    ElementaryStream& operator=(ElementaryStream&&) = default;
+    ElementaryStream(const ElementaryStream&) = delete;
+    ElementaryStream& operator=(const ElementaryStream&) = delete;
+
+    Codec codec() const {
+        return m_codec;
+    }
+
+    const std::vector<AccessUnit>& units() const {
+        return m_units;
+    }
+
+    std::span<const std::string_view> nals(const AccessUnit& unit) const {
+        return { m_nals.data() + unit.firstNal, unit.nalCount };
+    }
+
+    // Indexes of the keyframe units, ascending
+    const std::vector<uint32_t>& keyframes() const {
+        return m_keyframes;
+    }
+
+    // The last keyframe that arrived not later than `arrival`
+    std::optional<uint32_t> keyframeAt(util::timestamp_us arrival) const {
+        auto it = std::upper_bound(m_keyframes.begin(), m_keyframes.end(), arrival, [this](util::timestamp_us value, uint32_t unit) {
+            return value < m_units[unit].arrival;
+        });
+        if (it == m_keyframes.begin())
+            return {};
+        return *std::prev(it);
+    }
+
+    size_t corrupted() const {
+        return std::ranges::count_if(m_units, &AccessUnit::isCorrupted);
+    }
+
+    // Writes units [from, to) with start codes. If the first unit doesn't carry parameter sets,
+    // the latest ones sent before it are written first, so a clip cut at a keyframe is decodable.
+    void writeAnnexB(std::ostream& out, size_t from = 0, size_t to = SIZE_MAX) const {
+        to = std::min(to, m_units.size());
+        if (from >= to)
+            return;
+
+        auto first = nals(m_units[from]);
+        bool hasParameterSets = std::ranges::any_of(first, [this](std::string_view nal) {
+            return isParameterSet(m_codec, nalType(m_codec, nal));
+        });
+        if (!hasParameterSets) {
+            for (auto nal : parameterSetsBefore(m_units[from].firstNal))
+                writeNal(out, nal);
+        }
+
+        for (size_t i = from; i < to; ++i) {
+            for (auto nal : nals(m_units[i]))
+                writeNal(out, nal);
+        }
+    }
+
+private:
+    friend class Depacketizer;
+
+    static void writeNal(std::ostream& out, std::string_view nal) {
+        static constexpr char START_CODE[] = { 0, 0, 0, 1 };
+        out.write(START_CODE, sizeof(START_CODE));
+        out.write(nal.data(), static_cast<std::streamsize>(nal.size()));
+    }
+
+    // The latest parameter set of each type preceding NAL `end`
+    std::vector<std::string_view> parameterSetsBefore(uint32_t end) const {
+        std::vector<std::string_view> result;
+        std::vector<uint8_t> seen;
+        for (auto it = m_parameterSets.rbegin(); it != m_parameterSets.rend(); ++it) {
+            if (*it >= end)
+                continue;
+            const auto type = nalType(m_codec, m_nals[*it]);
+            if (std::ranges::find(seen, type) != seen.end())
+                continue;
+            seen.push_back(type);
+            result.insert(result.begin(), m_nals[*it]);
+        }
+        return result;
+    }
+
+    Codec m_codec;
+    std::vector<AccessUnit> m_units;
+    std::vector<std::string_view> m_nals;
+    std::vector<uint32_t> m_keyframes;
+    // indexes in m_nals
+    std::vector<uint32_t> m_parameterSets;
+    // fragmented NAL units put back together; a deque doesn't move its elements when it grows
+    std::deque<std::string> m_joined;
+};
+
+// RTP payload -> NAL units (RFC 6184 single NAL/STAP-A/FU-A, RFC 7798 single NAL/AP/FU).
+// Access units are split by the RTP timestamp and the marker bit.
+class Depacketizer
+{
+public:
+    explicit Depacketizer(Codec codec) :
+        m_stream(codec)
+    {}
+
+    // The packet `header` was parsed from must outlive the stream: only fragmented NAL units are copied
+    void feed(const rtp::Header& header, util::timestamp_us arrival) {
+        if (m_hasSequence && header.sequenceNumber != static_cast<uint16_t>(m_sequence + 1)) {
+            // a lost packet damages the current unit and any fragment in progress
+            m_isCorrupted = true;
+            m_fragment = nullptr;
+        }
+        m_hasSequence = true;
+        m_sequence = header.sequenceNumber;
+
+        if (m_isOpen && header.timestamp != m_unit.timestamp)
+            closeUnit();
+        if (!m_isOpen) {
+            m_unit = { header.timestamp, arrival, static_cast<uint32_t>(m_stream.m_nals.size()) };
+            m_isOpen = true;
+        }
+
+        if (m_stream.codec() == Codec::H264)
+            feedH264(header.payload);
+        else
+            feedH265(header.payload);
+
+        if (header.marker)
+            closeUnit();
+    }
+
+    ElementaryStream finish() {
+        closeUnit();
+        return std::move(m_stream);
+    }
+
+private:
+    void feedH264(std::string_view payload) {
+        if (payload.empty())
+            return;
+        const auto indicator = static_cast<uint8_t>(payload[0]);
+        switch (indicator & 0x1f) {
+        case 24:
+            // STAP-A: [16-bit size][NAL]...
+            aggregated(payload.substr(1));
+            break;
+        case 28: {
+            // FU-A: indicator, header (S|E|R|type), fragment
+            if (payload.size() < 2)
+                return;
+            const auto fu = static_cast<uint8_t>(payload[1]);
+            fragment(fu & 0x80, fu & 0x40, std::string{ static_cast<char>((indicator & 0xe0) | (fu & 0x1f)) }, payload.substr(2));
+            break;
+        }
+        case 0:
+        case 25:
+        case 26:
+        case 27:
+        case 29:
+        case 30:
+        case 31:
+            // STAP-B, MTAP and FU-B are only used in interleaved mode
+            m_isCorrupted = true;
+            break;
+        default:
+            nal(payload);
+        }
+    }
+
+    void feedH265(std::string_view payload) {
+        if (payload.size() < 2)
+            return;
+        switch ((static_cast<uint8_t>(payload[0]) >> 1) & 0x3f) {
+        case 48:
+            // AP: [16-bit size][NAL]...
+            aggregated(payload.substr(2));
+            break;
+        case 49: {
+            // FU: payload header, FU header (S|E|type), fragment
+            if (payload.size() < 3)
+                return;
+            const auto fu = static_cast<uint8_t>(payload[2]);
+            std::string nalHeader{ static_cast<char>((payload[0] & 0x81) | ((fu & 0x3f) << 1)), payload[1] };
+            fragment(fu & 0x80, fu & 0x40, std::move(nalHeader), payload.substr(3));
+            break;
+        }
+        case 50:
+            // PACI
+            m_isCorrupted = true;
+            break;
+        default:
+            nal(payload);
+        }
+    }
+
+    void aggregated(std::string_view data) {
+        while (data.size() >= 2) {
+            const size_t size = rtp::load16(data.data());
+            if (data.size() - 2 < size) {
+                m_isCorrupted = true;
+                return;
+            }
+            nal(data.substr(2, size));
+            data.remove_prefix(2 + size);
+        }
+    }
+
+    void fragment(bool isStart, bool isEnd, std::string nalHeader, std::string_view data) {
+        if (isStart) {
+            m_fragment = &m_stream.m_joined.emplace_back(std::move(nalHeader));
+        }
+        else if (!m_fragment) {
+            // the start was lost
+            m_isCorrupted = true;
+            return;
+        }
+        m_fragment->append(data);
+        if (isEnd) {
+            nal(*m_fragment);
+            m_fragment = nullptr;
+        }
+    }
+
+    void nal(std::string_view nal) {
+        if (nal.empty())
+            return;
+        auto& stream = m_stream;
+        const auto type = nalType(stream.codec(), nal);
+        if (isKeyframe(stream.codec(), type))
+            m_unit.isKeyframe = true;
+        if (isParameterSet(stream.codec(), type))
+            stream.m_parameterSets.push_back(static_cast<uint32_t>(stream.m_nals.size()));
+        stream.m_nals.push_back(nal);
+    }
+
+    void closeUnit() {
+        if (!m_isOpen)
+            return;
+        m_isOpen = false;
+        if (m_fragment) {
+            // the unit ended in the middle of a fragmented NAL
+            m_isCorrupted = true;
+            m_fragment = nullptr;
+        }
+
+        auto& stream = m_stream;
+        m_unit.nalCount = static_cast<uint32_t>(stream.m_nals.size()) - m_unit.firstNal;
+        m_unit.isCorrupted = m_isCorrupted;
+        m_isCorrupted = false;
+        if (m_unit.nalCount == 0)
+            return;
+        if (m_unit.isKeyframe)
+            stream.m_keyframes.push_back(static_cast<uint32_t>(stream.m_units.size()));
+        stream.m_units.push_back(m_unit);
+    }
+
+    ElementaryStream m_stream;
+    ElementaryStream::AccessUnit m_unit;
+    bool m_isOpen = false;
+    bool m_isCorrupted = false;
+    // fragmented NAL being joined
+    std::string* m_fragment = nullptr;
+    bool m_hasSequence = false;
+    uint16_t m_sequence = 0;
+};
+
+// Depacketizes the video tracks of a recorded stream, one elementary stream per interleaved channel.
+// Views point into `store`.
+inline std::unordered_map<uint8_t, ElementaryStream> depacketize(const PacketStore& store, std::string_view sdp) {
+    const auto codecs = sdpCodecs(sdp);
+    std::unordered_map<uint8_t, Depacketizer> tracks;
+    for (auto&& packet : store.packets()) {
+        if (!PacketStore::isRtp(packet.channel))
+            continue;
+        auto header = rtp::parseHeader(store.data(packet));
+        if (!header)
+            continue;
+        auto codec = codecs.find(header->payloadType);
+        if (codec == codecs.end())
+            continue;
+        tracks.try_emplace(packet.channel, codec->second).first->second.feed(*header, packet.arrival);
+    }
+
+    std::unordered_map<uint8_t, ElementaryStream> streams;
+    for (auto&& [channel, track] : tracks) {
+        streams.emplace(channel, track.finish());
+    }
+    return streams;
+}
+
+// Indexes of the packets where a keyframe access unit starts: the first packet with the RTP timestamp
+// of the keyframe, so parameter sets sent just before the IDR/IRAP are included
+inline std::vector<uint32_t> keyframePackets(const PacketStore& store, std::string_view sdp) {
+    const auto codecs = sdpCodecs(sdp);
+    std::vector<uint32_t> keyframes;
+    if (codecs.empty())
+        return keyframes;
+
+    struct Track
+    {
+        uint32_t timestamp = 0;
+        uint32_t firstPacket = 0;
+        bool isIndexed = false;
+    };
+    std::unordered_map<uint8_t, Track> tracks;
+    const auto& packets = store.packets();
+    for (uint32_t i = 0; i < packets.size(); ++i) {
+        if (!PacketStore::isRtp(packets[i].channel))
+            continue;
+        auto header = rtp::parseHeader(store.data(packets[i]));
+        if (!header)
+            continue;
+        auto codec = codecs.find(header->payloadType);
+        if (codec == codecs.end())
+            continue;
+
+        auto [it, isNew] = tracks.try_emplace(packets[i].channel);
+        auto& track = it->second;
+        if (isNew || header->timestamp != track.timestamp) {
+            track = { header->timestamp, i, false };
+        }
+        if (!track.isIndexed && startsKeyframe(codec->second, header->payload)) {
+            track.isIndexed = true;
+            keyframes.push_back(track.firstPacket);
+        }
+    }
+    // several video tracks are indexed independently
+    std::ranges::sort(keyframes);
+    return keyframes;
+}
+
+}
@@ -2,6 +2,8 @@
 
 #include "Utility.h"
 #include "PatternSeeker.h"
+#include "BodyStore.h"
+#include "ContentStore.h"
 
 #include <HttpLayer.h>
 
@@ -9,40 +11,64 @@
 #include <optional>
 #include <unordered_map>
 #include <memory>
+#include <array>
+#include <ctime>
+
+#include <boost/asio/buffer.hpp>
 
 using http_method_t = pcpp::HttpRequestLayer::HttpMethod;
 using namespace PatterSeekerNS;
 
+// `view` of `from` as the same bytes of `to`, which starts with a copy of `from` up to the end of `view`
+inline std::string_view rebase(std::string_view view, std::string_view from, std::string_view to) {
+    return view.empty() ? std::string_view{} : to.substr(static_cast<size_t>(view.data() - from.data()), view.size());
+}
+
+// Headers of an HTTP message that starts with the request or status line
+inline util::headers_view_t headersOf(std::string_view message) {
+    PatternSeeker parser{ message };
+    parser.extract("\n", move_after);
+    return util::parseHeaders(parser.extract("\r\n\r\n", move_after));
+}
+
 class HttpRequest
 {
-    std::shared_ptr<std::string> m_data{ new std::string };
+    // the bytes as they're recorded; m_data is the same string until share() replaces it with a shared copy
+    std::shared_ptr<std::string> m_recording{ new std::string };
+    std::shared_ptr<const std::string> m_data{ m_recording };
     std::string_view m_method;
     std::string_view m_uri;
     std::string_view m_body;
-    util::headers_view_t m_headers;
 
 public:
     bool isEmpty() const {
         return m_data->empty();
     }
+    // Only while the exchange is recorded, before share()
     void append(std::string_view newData) {
-        m_data->append(newData);
+        m_recording->append(newData);
     }
 
     std::string to_string() {
         return *m_data;
     }
 
+    // The recorded request as it came
+    std::string_view raw() const {
+        return *m_data;
+    }
+
     bool parse() {
         // method
-        static const std::string_view GET = "GET";
-        static const std::string_view POST = "POST";
+        static const std::string_view methods[] = { "GET", "POST", "PUT", "DELETE", "PATCH", "HEAD", "OPTIONS" };
 
         PatternSeeker parser{ *m_data };
-        if (parser.expect(GET))
-            m_method = GET;
-        if (parser.expect(POST))
-            m_method = POST;
+        for (auto&& method : methods) {
+            if (parser.expect(method)) {
+                m_method = method;
+                break;
+            }
+        }
 
         if (m_method.empty())
             return false;
@@ -58,16 +84,11 @@ public:
         m_uri = uri.to_string_view();
 
         // headers
-        m_headers = util::parseHeaders(parser.extract("\r\n\r\n", move_after));
-        if (m_headers.empty())
-            return false;
-
-        // body
-        auto lengthOpt = PatternSeeker(m_headers["Content-Length"]).takeUInt64();
-        if (!lengthOpt)
+        if (util::parseHeaders(parser.extract("\r\n\r\n", move_after)).empty())
             return false;
 
-        auto length = *lengthOpt;
+        // body, requests without Content-Length have none
+        auto length = PatternSeeker(util::findHeaderValue(*m_data, "Content-Length")).takeUInt64(0);
 
         auto body = parser.extract(length);
         if (body.isEmpty() && length > 0)
@@ -80,19 +101,36 @@ public:
 
         return true;
     }
-    std::string_view method() {
+
+    // Takes the recorded bytes from `store`, so equal requests keep one copy of them.
+    // Must be called after a successful parse().
+    void share(ContentStore& store) {
+        auto shared = store.intern(*m_data).bytes;
+        m_uri = rebase(m_uri, *m_data, *shared);
+        m_body = rebase(m_body, *m_data, *shared);
+        m_data = std::move(shared);
+        m_recording.reset();
+    }
+
+    // Value of the header `name` (case-insensitive) or an empty view
+    std::string_view header(std::string_view name) const {
+        return util::findHeaderValue(*m_data, name);
+    }
+
+    std::string_view method() const {
         return m_method;
     }
 
-    std::string_view uri() {
+    std::string_view uri() const {
         return m_uri;
     }
 
-    const util::headers_view_t& headers() {
-        return m_headers;
+    // Parsed on every call, the catalog doesn't keep them
+    util::headers_view_t headers() const {
+        return headersOf(*m_data);
     }
 
-    std::string_view body() {
+    std::string_view body() const {
         return m_body;
     }
 
@@ -107,24 +145,171 @@ public:
     }
 };
 
+// "Date: ...\r\n" header for the current second.
+// It's formatted at most once a second per thread, the view is valid until the next call on this thread:
+// other sessions of the thread call it too, so it's copied before a write that can be suspended.
+std::string_view httpDateHeader() {
+    thread_local std::time_t cachedAt = 0;
+    thread_local std::array<char, 64> header{};
+    thread_local size_t length = 0;
+
+    const std::time_t now = std::time(nullptr);
+    if (now != cachedAt) {
+        std::tm tm{};
+#ifdef _WIN32
+        gmtime_s(&tm, &now);
+#else
+        gmtime_r(&now, &tm);
+#endif
+        length = std::strftime(header.data(), header.size(), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        cachedAt = now;
+    }
+    return { header.data(), length };
+}
+
 struct HttpResponse
 {
-    std::shared_ptr<std::string> m_data{ new std::string };
+    // the bytes as they're recorded; m_data is the same string until the body is freed or the head is shared
+    std::shared_ptr<std::string> m_recording{ new std::string };
+    std::shared_ptr<const std::string> m_data{ m_recording };
     uint32_t m_code;
-    util::headers_view_t m_headers;
     std::string_view m_body;
+    // Status line and recorded headers, rendered once by prepare()
+    std::shared_ptr<const std::string> m_head;
+    // The answer to HEAD: there's no body, the recorded Content-Length is the size of the GET's one
+    bool m_isHeadResponse = false;
+    // Where the body is if it was moved to a BodyStore, m_body is empty then
+    std::optional<BodyStore::Ref> m_storedBody;
+    // Keeps m_body alive if it's not in m_data: the copy shared with equal responses (see share()) or a mapped bundle
+    std::shared_ptr<const void> m_bodyOwner;
 public:
+    // Buffers of the whole response: m_head, Date, Connection + end of headers, m_body.
+    // `date` is the "Date: ...\r\n" line (see httpDateHeader()) in storage of the connection.
+    using wire_buffers_t = std::array<boost::asio::const_buffer, 4>;
+
+    // Headers that are different for every request, they're never taken from the recording
+    static bool isPerRequestHeader(std::string_view name) {
+        static const std::string_view names[] = { "Date", "Connection", "Keep-Alive", "Content-Length", "Transfer-Encoding" };
+        return std::ranges::any_of(names, [name](auto&& perRequest) { return util::equalsIgnoreCase(name, perRequest); });
+    }
+
+    // Renders the recorded status line and headers (in recorded order) and the actual Content-Length,
+    // the recorded one for HEAD. Must be called after a successful parse().
+    void prepare() {
+        auto head = std::make_shared<std::string>();
+        std::string_view data = *m_data;
+        auto headersEnd = data.find("\r\n\r\n");
+        PatternSeeker parser{ data.substr(0, headersEnd) };
+
+        head->append(util::trim(parser.extract("\n", move_after).to_string_view())).append("\r\n");
+        while (parser.isNotEmpty()) {
+            auto lineParser = parser.extract("\n", move_after);
+            if (lineParser.isEmpty())
+                lineParser = std::exchange(parser, PatternSeeker{ "" });
+            auto line = util::trim(lineParser.to_string_view());
+            auto name = util::trim(line.substr(0, line.find(':')));
+            if (line.empty() || isPerRequestHeader(name))
+                continue;
+            head->append(line).append("\r\n");
+        }
+        if (!m_isHeadResponse)
+            head->append("Content-Length: ").append(std::to_string(m_body.size())).append("\r\n");
+        else if (auto length = util::findHeaderValue(data.substr(0, headersEnd), "Content-Length"); !length.empty())
+            head->append("Content-Length: ").append(length).append("\r\n");
+        m_head = std::move(head);
+    }
+
+    // Moves the body into `store` and frees it, only the recorded head stays in memory.
+    // Must be called after prepare().
+    void storeBody(BodyStore& store) {
+        m_storedBody = store.append(m_body);
+        keepHeadOnly();
+    }
+
+    // Takes the rendered head, the recorded head and the body from `store`, so equal responses keep one copy of them.
+    // Must be called after prepare(); a body moved to a BodyStore stays there.
+    void share(ContentStore& store) {
+        m_head = store.intern(*m_head).bytes;
+        if (!m_storedBody && !m_bodyOwner && !m_body.empty()) {
+            auto body = store.intern(m_body).bytes;
+            keepHeadOnly();
+            m_body = *body;
+            m_bodyOwner = std::move(body);
+        }
+        // only the head is left in m_data, nothing points into it
+        if (!m_bodyOwner)
+            m_body = {};
+        m_data = store.intern(*m_data).bytes;
+        m_recording.reset();
+    }
+
+    // Frees the body, only the recorded head stays in m_data
+    void keepHeadOnly() {
+        std::string_view data = *m_data;
+        m_data = std::make_shared<const std::string>(data.substr(0, static_cast<size_t>(m_body.data() - data.data())));
+        m_recording.reset();
+        m_body = {};
+    }
+
+    // Parsed on every call, the catalog doesn't keep them
+    util::headers_view_t headers() const {
+        return headersOf(*m_data);
+    }
+
+    bool isPrepared() const {
+        return m_head != nullptr;
+    }
+
+    // A response prepared before (see bundle::load): the recorded and the rendered head, `body` is kept alive by `bodyOwner`
+    static HttpResponse prepared(uint32_t code, std::shared_ptr<const std::string> recordedHead, std::shared_ptr<const std::string> head,
+        std::string_view body, std::shared_ptr<const void> bodyOwner) {
+        HttpResponse response;
+        response.m_recording.reset();
+        response.m_data = std::move(recordedHead);
+        response.m_code = code;
+        response.m_head = std::move(head);
+        response.m_body = body;
+        response.m_bodyOwner = std::move(bodyOwner);
+        return response;
+    }
+
+    // The response ready to be sent, nothing is copied or formatted
+    wire_buffers_t wire(std::string_view date, bool keepAlive) const {
+        return wire(*m_head, m_body, date, keepAlive);
+    }
+
+    // Answer for requests that have nothing similar in the recording
+    static wire_buffers_t notFound(std::string_view date, bool keepAlive) {
+        static const std::string_view HEAD = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n";
+        return wire(HEAD, {}, date, keepAlive);
+    }
+
+    // Head (status line and headers up to Date) + Date + Connection + body;
+    // `head`, `body` and `date` must outlive the write
+    static wire_buffers_t wire(std::string_view head, std::string_view body, std::string_view date, bool keepAlive) {
+        static const std::string_view KEEP_ALIVE = "Connection: keep-alive\r\n\r\n";
+        static const std::string_view CLOSE = "Connection: close\r\n\r\n";
+        return {
+            boost::asio::buffer(head),
+            boost::asio::buffer(date),
+            boost::asio::buffer(keepAlive ? KEEP_ALIVE : CLOSE),
+            boost::asio::buffer(body),
+        };
+    }
+
     bool isEmpty() const {
         return m_data->empty();
     }
+    // Only while the exchange is recorded, before the body is freed or the head is shared
     void append(std::string_view newData) {
-        m_data->append(newData);
+        m_recording->append(newData);
     }
     std::string to_string() {
         return *m_data;
     }
 
-    bool parse() {
+    // `isHead` - it answers HEAD, so there's no body whatever Content-Length says
+    bool parse(bool isHead = false) {
         PatternSeeker parser{ *m_data };
         if (!parser.expect("HTTP/1.1 "))
             return false;
@@ -136,12 +321,18 @@ public:
 
         parser.extract("\n", move_after);
 
-        m_headers = util::parseHeaders(parser.extract("\r\n\r\n", move_after));
-        if (m_headers.empty())
+        auto headers = util::parseHeaders(parser.extract("\r\n\r\n", move_after));
+        if (headers.empty())
             return false;
 
+        if (isHead) {
+            m_isHeadResponse = true;
+            prepare();
+            return true;
+        }
+
         // body
-        auto lengthOpt = PatternSeeker(m_headers["Content-Length"]).takeUInt64();
+        auto lengthOpt = PatternSeeker(headers["Content-Length"]).takeUInt64();
         if (!lengthOpt)
             return false;
 
@@ -155,13 +346,14 @@ public:
             std::cout << "WARNING! Body size is not equal to length\n";
         }
         m_body = body.to_string_view();
+        prepare();
 
         return true;
     }
 
     friend std::ostream& operator<<(std::ostream& oss, HttpResponse& resp) {
         oss << resp.m_code;
-        for (auto&& [header, val] : resp.m_headers) {
+        for (auto&& [header, val] : resp.headers()) {
             oss << '\n' << header << ": " << val;
         }
         if (!resp.m_body.empty())
@@ -180,7 +372,7 @@ struct RequestResponse
     }
 
     bool parse() {
-        return request.parse() && response.parse();
+        return request.parse() && response.parse(request.method() == "HEAD");
     }
 
     std::string to_string() {
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/socket_base.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// IoContextPool owns N single-threaded io_contexts, one thread per context.
+// Everything spawned on a context stays on its thread, so a session never needs a strand.
+class IoContextPool
+{
+    using net_context_t = boost::asio::io_context;
+    using work_guard_t = boost::asio::executor_work_guard<net_context_t::executor_type>;
+
+public:
+    // SO_REUSEPORT lets every context own an acceptor on the same port and the kernel
+    // balances incoming connections between them.
+    // Where it's unavailable (e.g. Windows) we use one acceptor and hand sockets out round-robin.
+#ifdef SO_REUSEPORT
+    static constexpr bool hasReusePort = true;
+    using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#else
+    static constexpr bool hasReusePort = false;
+#endif
+
+    // 0 means one context per hardware thread
+    explicit IoContextPool(std::size_t size = 0) {
+        if (size == 0)
+            size = std::max(1u, std::thread::hardware_concurrency());
+
+        for (std::size_t i = 0; i < size; ++i) {
+            // concurrency hint 1: the context is only ever run from its own thread
+            m_contexts.push_back(std::make_unique<net_context_t>(1));
+            m_work.push_back(boost::asio::make_work_guard(*m_contexts.back()));
+        }
+    }
+
+    IoContextPool(const IoContextPool&) = delete;
+    IoContextPool& operator=(const IoContextPool&) = delete;
+
+    std::size_t size() const {
+        return m_contexts.size();
+    }
+
+    net_context_t& get(std::size_t i) {
+        return *m_contexts[i % m_contexts.size()];
+    }
+
+    // Round-robin. Only called from the thread that runs the single acceptor.
+    net_context_t& next() {
+        return get(m_next++);
+    }
+
+    // Opens a listening acceptor on `endpoint` bound to `ioc`.
+    // With SO_REUSEPORT it may be called once per context for the same endpoint.
+    static boost::asio::ip::tcp::acceptor makeAcceptor(net_context_t& ioc, const boost::asio::ip::tcp::endpoint& endpoint) {
+        boost::asio::ip::tcp::acceptor acceptor{ ioc };
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+#ifdef SO_REUSEPORT
+        acceptor.set_option(reuse_port(true));
+#endif
+        acceptor.bind(endpoint);
+        acceptor.listen(boost::asio::socket_base::max_listen_connections);
+        return acceptor;
+    }
+
+    // Runs every context on its own thread and blocks until all of them are stopped.
+    // The calling thread runs the first context.
+    void run() {
+        std::vector<std::jthread> threads;
+        threads.reserve(m_contexts.size() - 1);
+        for (std::size_t i = 1; i < m_contexts.size(); ++i) {
+            threads.emplace_back([&ioc = *m_contexts[i]] { ioc.run(); });
+        }
+        m_contexts.front()->run();
+    }
+
+    // Safe to call from any thread
+    void stop() {
+        for (auto& ioc : m_contexts) {
+            ioc->stop();
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<net_context_t>> m_contexts;
+    std::vector<work_guard_t> m_work;
+    std::size_t m_next = 0;
+};
@@ -0,0 +1,484 @@
+#pragma once
+
+#include "PacketStore.h"
+#include "Raysharp.h"
+#include "Rtp.h"
+#include "RtpAnalyzer.h"
+#include "Utility.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Virtual cameras for recorder stress tests: a recorded stream is the template,
+// every camera replays it in a loop with its own SSRCs, sequence numbers, timestamps
+// and randomized Raysharp target boxes.
+namespace loadgen {
+
+struct Options
+{
+    size_t cameras = 1;
+    // targets per metadata result, nothing - as recorded
+    std::optional<uint16_t> targets;
+    // metadata results per second, 0 - as recorded
+    double metadataRate = 0;
+    uint64_t seed = 1;
+    // every track of every camera to its own port, see Ports
+    bool portPerTrack = true;
+};
+
+// UDP ports the cameras send to. With `perTrack` every track of every camera has its own port pair
+// (RTP on the even port, RTCP would be the next one), so a recorder set up with the camera's SDP (see cameraSdp())
+// receives each camera like a real one. Otherwise everything goes to `basePort`,
+// which only a sink that tells the cameras and tracks apart by SSRC can use.
+struct Ports
+{
+    uint16_t basePort = 5004;
+    bool perTrack = true;
+
+    uint64_t of(uint32_t camera, size_t tracks, uint8_t track) const {
+        return perTrack ? basePort + 2 * (uint64_t{ camera } * tracks + track) : basePort;
+    }
+};
+
+// splitmix64: cheap and good enough for coordinates and initial RTP values
+class Random
+{
+public:
+    explicit Random(uint64_t seed) :
+        m_state(seed)
+    {}
+
+    uint64_t next() {
+        uint64_t z = (m_state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // [0, bound)
+    uint32_t below(uint32_t bound) {
+        return static_cast<uint32_t>((next() >> 32) * bound >> 32);
+    }
+
+private:
+    uint64_t m_state;
+};
+
+// Fixed-size buffers that are taken and given back without allocating.
+// When all of them are in use the pool grows by a whole slab. Not thread-safe: one pool per thread.
+class BufferPool
+{
+public:
+    explicit BufferPool(size_t bufferSize, size_t buffersPerSlab = 256) :
+        m_bufferSize(bufferSize),
+        m_buffersPerSlab(std::max<size_t>(1, buffersPerSlab))
+    {}
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    std::span<char> acquire() {
+        if (m_free.empty())
+            grow();
+        char* buffer = m_free.back();
+        m_free.pop_back();
+        return { buffer, m_bufferSize };
+    }
+
+    void release(std::span<char> buffer) {
+        m_free.push_back(buffer.data());
+    }
+
+    size_t bufferSize() const {
+        return m_bufferSize;
+    }
+
+    size_t capacity() const {
+        return m_slabs.size() * m_buffersPerSlab;
+    }
+
+private:
+    void grow() {
+        m_slabs.push_back(std::make_unique_for_overwrite<char[]>(m_bufferSize * m_buffersPerSlab));
+        m_free.reserve(capacity());
+        for (size_t i = 0; i < m_buffersPerSlab; ++i) {
+            m_free.push_back(m_slabs.back().get() + i * m_bufferSize);
+        }
+    }
+
+    size_t m_bufferSize;
+    size_t m_buffersPerSlab;
+    std::vector<std::unique_ptr<char[]>> m_slabs;
+    std::vector<char*> m_free;
+};
+
+// The RTP packets of a recorded stream prepared for looping: RTCP is dropped (its reports would
+// describe the recorded SSRCs), metadata results are located or synthesized once, so building
+// a packet is one memcpy plus patching a few fields.
+class Template
+{
+public:
+    struct Entry
+    {
+        // since the start of a loop
+        util::timestamp_us offset = 0;
+        std::string_view bytes;
+        uint8_t channel = 0;
+        // index of the recorded SSRC
+        uint8_t track = 0;
+        // RTP timestamp since the first one of the track
+        uint32_t timestampDelta = 0;
+        // target records to randomize, count == 0 - nothing to randomize
+        size_t recordsOffset = 0;
+        uint16_t recordCount = 0;
+        uint16_t recordStride = 0;
+    };
+
+    Template(const PacketStore& store, std::string_view sdp, const Options& options) {
+        const auto clockRates = rtp::sdpClockRates(sdp);
+        std::unordered_map<uint32_t, uint8_t> trackOf;
+        std::optional<util::timestamp_us> start;
+
+        for (auto&& packet : store.packets()) {
+            if (!PacketStore::isRtp(packet.channel))
+                continue;
+            auto bytes = store.data(packet);
+            auto header = rtp::parseHeader(bytes);
+            if (!header)
+                continue;
+            if (!start)
+                start = packet.arrival;
+
+            auto [it, isNew] = trackOf.try_emplace(header->ssrc, static_cast<uint8_t>(m_tracks.size()));
+            if (isNew) {
+                auto rate = clockRates.find(header->payloadType);
+                m_tracks.push_back({ header->timestamp, 0, rate == clockRates.end() ? 0 : rate->second, header->payloadType });
+            }
+
+            Entry entry;
+            entry.offset = packet.arrival - *start;
+            entry.bytes = bytes;
+            entry.channel = packet.channel;
+            entry.track = it->second;
+            entry.timestampDelta = header->timestamp - m_tracks[entry.track].firstTimestamp;
+
+            // only results that fit in one packet are rewritten, others are replayed as they are
+            const bool isMetadata = header->payloadType == Raysharp::PAYLOAD_TYPE;
+            auto results = isMetadata && header->marker ? Raysharp::locateResults(header->payload) : std::nullopt;
+            if (results) {
+                const size_t payloadOffset = header->payload.data() - bytes.data();
+                entry.recordsOffset = payloadOffset + results->recordsOffset;
+                entry.recordCount = results->count;
+                entry.recordStride = results->stride;
+                if (options.targets || options.metadataRate > 0) {
+                    // every result is replaced by one synthesized from the first result
+                    if (m_prototypeBytes.empty()) {
+                        m_prototypeBytes = makePrototype(bytes, payloadOffset, *results, options.targets.value_or(results->count));
+                        m_prototype = entry;
+                        m_prototype.bytes = m_prototypeBytes;
+                        m_prototype.recordStride = static_cast<uint16_t>(wire::sizeOf<Raysharp::IVA_REPORT_RESULT_INFO_V1_S>);
+                        m_prototype.recordCount = static_cast<uint16_t>((m_prototypeBytes.size() - entry.recordsOffset) / m_prototype.recordStride);
+                    }
+                    // at a fixed rate they're added after the recorded packets are collected
+                    if (options.metadataRate > 0)
+                        continue;
+                    const auto offset = entry.offset;
+                    const auto timestampDelta = entry.timestampDelta;
+                    entry = m_prototype;
+                    entry.offset = offset;
+                    entry.timestampDelta = timestampDelta;
+                }
+            }
+            m_entries.push_back(entry);
+            m_duration = entry.offset;
+        }
+
+        if (options.metadataRate > 0 && !m_prototypeBytes.empty())
+            addSyntheticResults(options);
+        finalize();
+    }
+
+    // entries point into the template
+    Template(const Template&) = delete;
+    Template& operator=(const Template&) = delete;
+
+    const std::vector<Entry>& entries() const {
+        return m_entries;
+    }
+
+    bool isEmpty() const {
+        return m_entries.empty();
+    }
+
+    size_t tracks() const {
+        return m_tracks.size();
+    }
+
+    // Time of one loop, the gap before the first packet of the next loop included
+    util::timestamp_us period() const {
+        return m_period;
+    }
+
+    // RTP timestamp advance of a track per loop
+    uint32_t timestampPeriod(uint8_t track) const {
+        return m_tracks[track].timestampPeriod;
+    }
+
+    uint8_t payloadType(uint8_t track) const {
+        return m_tracks[track].payloadType;
+    }
+
+    // Most target records in one packet, the size of every camera's block of target ids
+    uint32_t maxRecords() const {
+        return m_maxRecords;
+    }
+
+    // Cameras whose target ids fit into 32 bits
+    uint64_t maxCameras() const {
+        return (uint64_t{ UINT32_MAX } + 1) / m_maxRecords;
+    }
+
+    size_t maxPacketSize() const {
+        size_t size = 0;
+        for (auto&& entry : m_entries) {
+            size = std::max(size, entry.bytes.size());
+        }
+        return size;
+    }
+
+private:
+    struct Track
+    {
+        uint32_t firstTimestamp;
+        uint32_t timestampPeriod;
+        uint32_t clockRate;
+        uint8_t payloadType;
+    };
+
+    // A result packet with `targets` records, the records repeat the recorded ones (or are zero).
+    // Records are truncated to V1, the counts and the body length are patched.
+    static std::string makePrototype(std::string_view packet, size_t payloadOffset, const Raysharp::ResultLayout& layout, uint16_t targets) {
+        constexpr size_t recordSize = wire::sizeOf<Raysharp::IVA_REPORT_RESULT_INFO_V1_S>;
+        // the packet has to fit into a UDP datagram and an interleaved frame
+        const size_t prefix = payloadOffset + layout.recordsOffset;
+        targets = static_cast<uint16_t>(std::min<size_t>(targets, (UINT16_MAX - prefix) / recordSize));
+
+        std::string prototype(packet.substr(0, prefix));
+        // no padding: the records end the packet
+        prototype[0] = static_cast<char>(prototype[0] & ~0x20);
+        prototype.resize(prefix + targets * recordSize);
+        for (size_t i = 0; i < targets && layout.count > 0; ++i) {
+            const size_t source = prefix + (i % layout.count) * layout.stride;
+            std::memcpy(prototype.data() + prefix + i * recordSize, packet.data() + source, recordSize);
+        }
+
+        char* payload = prototype.data() + payloadOffset;
+        util::storeBigEndian(payload + Raysharp::MGR_BODY_LENGTH_OFFSET, static_cast<uint16_t>(prototype.size() - payloadOffset - layout.headOffset));
+        util::storeBigEndian(payload + layout.headOffset + Raysharp::RESULT_TARGET_NUM_OFFSET, targets);
+        util::storeBigEndian(payload + layout.headOffset + Raysharp::RESULT_PER_TARGET_SZ_OFFSET, static_cast<uint16_t>(recordSize));
+        return prototype;
+    }
+
+    // Results at a fixed rate on the track of the prototype, merged into the recorded packets by time
+    void addSyntheticResults(const Options& options) {
+        const uint8_t track = m_prototype.track;
+        const auto clockRate = m_tracks[track].clockRate ? m_tracks[track].clockRate : 90000;
+        const auto interval = static_cast<util::timestamp_us>(1'000'000 / options.metadataRate);
+        if (interval == 0)
+            return;
+
+        std::vector<Entry> merged;
+        merged.reserve(m_entries.size() + m_duration / interval + 1);
+        auto recorded = m_entries.begin();
+        for (util::timestamp_us at = 0; at <= m_duration; at += interval) {
+            for (; recorded != m_entries.end() && recorded->offset <= at; ++recorded) {
+                merged.push_back(*recorded);
+            }
+            Entry entry = m_prototype;
+            entry.offset = at;
+            entry.timestampDelta = static_cast<uint32_t>(at * clockRate / 1'000'000);
+            merged.push_back(entry);
+        }
+        merged.insert(merged.end(), recorded, m_entries.end());
+        m_entries = std::move(merged);
+    }
+
+    // The next loop starts one average packet gap after the last packet,
+    // timestamps advance by the loop period in the track's clock (or by its recorded span if the clock is unknown)
+    void finalize() {
+        for (auto&& entry : m_entries) {
+            m_maxRecords = std::max<uint32_t>(m_maxRecords, entry.recordCount);
+        }
+        const auto gap = m_entries.size() > 1 ? m_duration / (m_entries.size() - 1) : 1'000'000;
+        m_period = m_duration + std::max<util::timestamp_us>(gap, 1);
+
+        std::vector<uint32_t> lastDelta(m_tracks.size(), 0);
+        std::vector<uint32_t> packets(m_tracks.size(), 0);
+        for (auto&& entry : m_entries) {
+            lastDelta[entry.track] = std::max(lastDelta[entry.track], entry.timestampDelta);
+            ++packets[entry.track];
+        }
+        for (size_t i = 0; i < m_tracks.size(); ++i) {
+            auto& track = m_tracks[i];
+            if (track.clockRate)
+                track.timestampPeriod = static_cast<uint32_t>(m_period * track.clockRate / 1'000'000);
+            else
+                track.timestampPeriod = lastDelta[i] + std::max<uint32_t>(1, lastDelta[i] / std::max<uint32_t>(1, packets[i]));
+        }
+    }
+
+    std::vector<Entry> m_entries;
+    std::vector<Track> m_tracks;
+    std::string m_prototypeBytes;
+    // bytes point to m_prototypeBytes
+    Entry m_prototype;
+    util::timestamp_us m_duration = 0;
+    util::timestamp_us m_period = 0;
+    uint32_t m_maxRecords = 1;
+};
+
+// One emulated camera: a cursor over the template and the RTP state of its tracks.
+// The state is a few words, so thousands of cameras cost nothing but the packets they send.
+class VirtualCamera
+{
+public:
+    // `startOffset` staggers the cameras, so they don't all send their keyframes at once
+    VirtualCamera(const Template& tmpl, uint32_t id, uint64_t seed, util::timestamp_us startOffset = 0) :
+        m_template(&tmpl),
+        m_id(id),
+        m_random(seed ^ (static_cast<uint64_t>(id) << 32 | id)),
+        m_startOffset(startOffset)
+    {
+        m_tracks.resize(tmpl.tracks());
+        for (auto& track : m_tracks) {
+            track.ssrc = static_cast<uint32_t>(m_random.next());
+            track.sequence = static_cast<uint16_t>(m_random.next());
+            track.timestamp = static_cast<uint32_t>(m_random.next());
+        }
+    }
+
+    uint32_t id() const {
+        return m_id;
+    }
+
+    uint32_t ssrc(size_t track) const {
+        return m_tracks[track].ssrc;
+    }
+
+    // When the next packet is due, relative to the start of the generator
+    util::timestamp_us nextDue() const {
+        return m_startOffset + m_loop * m_template->period() + m_template->entries()[m_next].offset;
+    }
+
+    // Builds the next packet into `out` (at least Template::maxPacketSize() bytes) and moves on.
+    // Returns the size of the packet, `track` is the template track it belongs to.
+    size_t buildNext(std::span<char> out, uint8_t& track) {
+        const auto& entry = m_template->entries()[m_next];
+        auto& state = m_tracks[entry.track];
+        char* p = out.data();
+        std::memcpy(p, entry.bytes.data(), entry.bytes.size());
+        util::storeBigEndian(p + 2, state.sequence++);
+        util::storeBigEndian(p + 4, state.timestamp + static_cast<uint32_t>(m_loop) * m_template->timestampPeriod(entry.track) + entry.timestampDelta);
+        util::storeBigEndian(p + 8, state.ssrc);
+        randomizeTargets(p, entry);
+        track = entry.track;
+
+        if (++m_next == m_template->entries().size()) {
+            m_next = 0;
+            ++m_loop;
+        }
+        return entry.bytes.size();
+    }
+
+private:
+    struct TrackState
+    {
+        uint32_t ssrc = 0;
+        uint16_t sequence = 0;
+        uint32_t timestamp = 0;
+    };
+
+    // Boxes at random places of the 0-10000 frame. Every camera has its own block of
+    // Template::maxRecords() ids, so ids never repeat across cameras (see maxCameras())
+    void randomizeTargets(char* packet, const Template::Entry& entry) {
+        const uint32_t firstId = m_id * m_template->maxRecords();
+        for (size_t i = 0; i < entry.recordCount; ++i) {
+            char* record = packet + entry.recordsOffset + i * entry.recordStride;
+            const auto x = static_cast<uint16_t>(m_random.below(9000));
+            const auto y = static_cast<uint16_t>(m_random.below(9000));
+            util::storeBigEndian(record + Raysharp::TARGET_ID_OFFSET, firstId + static_cast<uint32_t>(i));
+            util::storeBigEndian(record + Raysharp::TARGET_START_OFFSET, x);
+            util::storeBigEndian(record + Raysharp::TARGET_START_OFFSET + 2, y);
+            util::storeBigEndian(record + Raysharp::TARGET_END_OFFSET, static_cast<uint16_t>(x + 100 + m_random.below(900)));
+            util::storeBigEndian(record + Raysharp::TARGET_END_OFFSET + 2, static_cast<uint16_t>(y + 100 + m_random.below(900)));
+        }
+    }
+
+    const Template* m_template;
+    uint32_t m_id;
+    Random m_random;
+    util::timestamp_us m_startOffset;
+    std::vector<TrackState> m_tracks;
+    size_t m_next = 0;
+    uint64_t m_loop = 0;
+};
+
+
+// The recorded SDP as camera `camera` sends it: every m= line gets the port of its track
+// (0 - the camera doesn't send it), a c= line with `host` and an a=ssrc line with the camera's SSRC at the end of the section
+inline std::string cameraSdp(std::string_view recordedSdp, const Template& tmpl, const VirtualCamera& camera, std::string_view host, const Ports& ports) {
+    const std::string_view addressType = host.find(':') == std::string_view::npos ? "IP4" : "IP6";
+    std::string sdp;
+    sdp.reserve(recordedSdp.size() + 128);
+    // attributes follow c= and b= lines, so the SSRC goes after the section
+    std::string ssrcLine;
+    while (!recordedSdp.empty()) {
+        auto end = recordedSdp.find('\n');
+        auto line = recordedSdp.substr(0, end);
+        recordedSdp = end == std::string_view::npos ? std::string_view{} : recordedSdp.substr(end + 1);
+        line = util::trim(line);
+        // the address is set per media section
+        if (line.empty() || line.starts_with("c="))
+            continue;
+        if (!line.starts_with("m=")) {
+            sdp.append(line).append("\r\n");
+            continue;
+        }
+
+        sdp.append(ssrcLine);
+        ssrcLine.clear();
+        // m=<media> <port> <proto> <fmt> ...
+        auto fields = util::split(line, ' ');
+        std::optional<uint8_t> track;
+        for (size_t i = 3; i < fields.size() && !track; ++i) {
+            const auto payloadType = PatterSeekerNS::PatternSeeker(fields[i]).takeUInt64(256);
+            for (uint8_t t = 0; t < tmpl.tracks(); ++t) {
+                if (tmpl.payloadType(t) == payloadType)
+                    track = t;
+            }
+        }
+        const auto port = track ? ports.of(camera.id(), tmpl.tracks(), *track) : 0;
+        sdp.append(fields.empty() ? "m=" : fields[0]).append(" ").append(std::to_string(port));
+        for (size_t i = 2; i < fields.size(); ++i) {
+            sdp.append(" ").append(fields[i]);
+        }
+        sdp.append("\r\n");
+        sdp.append("c=IN ").append(addressType).append(" ").append(host).append("\r\n");
+        if (track)
+            ssrcLine = fmt::format("a=ssrc:{} cname:camera{}\r\n", camera.ssrc(*track), camera.id());
+    }
+    sdp.append(ssrcLine);
+    return sdp;
+}
+
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "PacketStore.h"
+#include "Utility.h"
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// Dump of the media packets of one RTSP stream: records of
+//   32-bit length | 8-bit interleaved channel | 64-bit arrival (µs since the epoch) | bytes
+// little-endian, back to back after an 8-byte magic. Any bytes can be stored, nothing is escaped,
+// and loading is a linear scan over the mapped file that indexes the packets in place.
+namespace dump {
+
+constexpr std::string_view MAGIC = "RTSPDMP1";
+constexpr size_t RECORD_HEADER_SIZE = 13;
+
+class Writer
+{
+public:
+    explicit Writer(const std::filesystem::path& path) :
+        m_out(path, std::ios::binary | std::ios::trunc)
+    {
+        m_out.write(MAGIC.data(), static_cast<std::streamsize>(MAGIC.size()));
+    }
+
+    bool isOpen() const {
+        return m_out.is_open();
+    }
+
+    void write(uint8_t channel, std::string_view data, util::timestamp_us arrival) {
+        std::array<char, RECORD_HEADER_SIZE> header;
+        util::storeLittleEndian(header.data(), static_cast<uint32_t>(data.size()));
+        header[4] = static_cast<char>(channel);
+        util::storeLittleEndian(header.data() + 5, static_cast<uint64_t>(arrival));
+        m_out.write(header.data(), static_cast<std::streamsize>(header.size()));
+        m_out.write(data.data(), static_cast<std::streamsize>(data.size()));
+    }
+
+private:
+    std::ofstream m_out;
+};
+
+// The packets of a dump as a PacketStore over the mapped file: the index is built with one scan,
+// the bytes aren't copied and the mapping lives as long as the store (or a copy of it).
+// A truncated last record (the capture was cut) ends the scan. Nothing if the file isn't a dump.
+inline std::optional<PacketStore> load(const std::filesystem::path& path) {
+    namespace bip = boost::interprocess;
+    std::error_code ec;
+    if (std::filesystem::file_size(path, ec) <= MAGIC.size() || ec)
+        return {};
+
+    struct Mapping
+    {
+        bip::file_mapping file;
+        bip::mapped_region region;
+    };
+    auto mapping = std::make_shared<Mapping>();
+    try {
+        mapping->file = bip::file_mapping(path.string().c_str(), bip::read_only);
+        mapping->region = bip::mapped_region(mapping->file, bip::read_only);
+    }
+    catch (const bip::interprocess_exception&) {
+        return {};
+    }
+
+    std::string_view bytes{ static_cast<const char*>(mapping->region.get_address()), mapping->region.get_size() };
+    if (!bytes.starts_with(MAGIC))
+        return {};
+
+    std::vector<PacketStore::Packet> packets;
+    for (size_t pos = MAGIC.size(); bytes.size() - pos >= RECORD_HEADER_SIZE;) {
+        const char* header = bytes.data() + pos;
+        const auto length = util::loadLittleEndian<uint32_t>(header);
+        if (bytes.size() - pos - RECORD_HEADER_SIZE < length)
+            break;
+        packets.push_back({ pos + RECORD_HEADER_SIZE, length, static_cast<uint8_t>(header[4]), util::loadLittleEndian<uint64_t>(header + 5) });
+        pos += RECORD_HEADER_SIZE + length;
+    }
+    return PacketStore::view(bytes, std::move(packets), std::move(mapping));
+}
+
+}
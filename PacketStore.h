@@ -0,0 +1,196 @@
+#pragma once
+
+#include "Utility.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Media packets of one recorded stream in capture order, in arrival order once sortByArrival() is called.
+// The bytes of all packets live in one contiguous buffer and are handed out as views.
+// RTP/RTCP packets are stored without the 4-byte interleaved header,
+// so packets that came over TCP and over UDP look the same.
+// A store can also be a view of bytes that live elsewhere (a mapped replay bundle).
+class PacketStore
+{
+public:
+    struct Packet
+    {
+        uint64_t offset;
+        uint32_t size;
+        // interleaved channel: even - RTP, odd - RTCP of the same track
+        uint8_t channel;
+        util::timestamp_us arrival;
+    };
+
+    static bool isRtp(uint8_t channel) {
+        return channel % 2 == 0;
+    }
+
+    // Packets of `bytes` that `owner` keeps alive, nothing is copied. Such a store can't be appended to.
+    static PacketStore view(std::string_view bytes, std::vector<Packet> packets, std::shared_ptr<const void> owner) {
+        PacketStore store;
+        store.m_view = bytes;
+        store.m_packets = std::move(packets);
+        store.m_owner = std::move(owner);
+        return store;
+    }
+
+    void append(uint8_t channel, std::string_view data, util::timestamp_us arrival) {
+        m_packets.push_back(Packet{ m_bytes.size(), static_cast<uint32_t>(data.size()), channel, arrival });
+        m_bytes.append(data);
+    }
+
+    // All packets back to back, Packet::offset is relative to it
+    std::string_view bytes() const {
+        return m_owner ? m_view : std::string_view{ m_bytes };
+    }
+
+    std::string_view data(const Packet& packet) const {
+        return { bytes().data() + packet.offset, packet.size };
+    }
+
+    std::string_view data(size_t i) const {
+        return data(m_packets[i]);
+    }
+
+    const std::vector<Packet>& packets() const {
+        return m_packets;
+    }
+
+    size_t size() const {
+        return m_packets.size();
+    }
+
+    bool isEmpty() const {
+        return m_packets.empty();
+    }
+
+    // "$<channel><16-bit length>" that precedes the packet on an RTSP connection
+    static std::array<char, 4> interleavedHeader(const Packet& packet) {
+        return { '$', static_cast<char>(packet.channel), static_cast<char>(packet.size >> 8), static_cast<char>(packet.size & 0xff) };
+    }
+
+    // Orders the packets by arrival, packets that arrived at the same time keep their order.
+    // A capture isn't always in time order (reordered timestamps, UDP datagrams next to reassembled TCP),
+    // replay and seeking need it to be. Only the index is reordered, the bytes stay where they are.
+    void sortByArrival() {
+        auto byArrival = [](const Packet& packet) { return packet.arrival; };
+        if (!std::ranges::is_sorted(m_packets, {}, byArrival))
+            std::ranges::stable_sort(m_packets, {}, byArrival);
+    }
+
+    void shrinkToFit() {
+        m_bytes.shrink_to_fit();
+        m_packets.shrink_to_fit();
+    }
+
+private:
+    std::string m_bytes;
+    std::vector<Packet> m_packets;
+    // set for a view
+    std::string_view m_view;
+    std::shared_ptr<const void> m_owner;
+};
+
+// Splits the server->client byte stream of an RTSP connection into interleaved frames
+// "$<channel><16-bit length><data>" and puts them into a PacketStore.
+// RTSP responses between the frames (GET_PARAMETER keep-alives, PAUSE, TEARDOWN) are handed to the caller.
+// Only a frame or a response that is split between TCP segments is buffered, everything else is parsed in place.
+class InterleavedDeframer
+{
+public:
+    static constexpr std::string_view RESPONSE = "RTSP/1.0";
+    // a response that doesn't end by then isn't one
+    static constexpr size_t MAX_RESPONSE_SIZE = 64 * 1024;
+
+    // `onResponse(std::string_view)` is called for every complete response
+    template<typename OnResponse>
+    void feed(std::string_view data, util::timestamp_us arrival, PacketStore& store, OnResponse&& onResponse) {
+        if (m_pending.empty()) {
+            auto consumed = deframe(data, arrival, store, onResponse);
+            m_pending.assign(data.substr(consumed));
+            return;
+        }
+
+        m_pending.append(data);
+        auto consumed = deframe(m_pending, arrival, store, onResponse);
+        m_pending.erase(0, consumed);
+    }
+
+    // The last frame or response isn't complete yet, so the next segment continues it
+    bool isPending() const {
+        return !m_pending.empty();
+    }
+
+    // Bytes that weren't part of any frame or response
+    size_t skipped() const {
+        return m_skipped;
+    }
+
+private:
+    // Returns how many bytes were consumed, the rest is an incomplete frame or response
+    template<typename OnResponse>
+    size_t deframe(std::string_view data, util::timestamp_us arrival, PacketStore& store, OnResponse& onResponse) {
+        size_t pos = 0;
+        while (pos < data.size()) {
+            auto rest = data.substr(pos);
+            if (rest.starts_with(RESPONSE.substr(0, std::min(rest.size(), RESPONSE.size())))) {
+                if (rest.size() < RESPONSE.size())
+                    break;
+                auto size = responseSize(rest);
+                if (size == 0) {
+                    if (rest.size() <= MAX_RESPONSE_SIZE)
+                        break;
+                    // not a response after all
+                    ++m_skipped;
+                    ++pos;
+                    continue;
+                }
+                if (rest.size() < size)
+                    break;
+                onResponse(rest.substr(0, size));
+                pos += size;
+                continue;
+            }
+            if (data[pos] != '$') {
+                // not a frame: resynchronize on the next '$' or response
+                auto next = std::min(data.find('$', pos), data.find(RESPONSE, pos));
+                next = next == std::string_view::npos ? data.size() : next;
+                m_skipped += next - pos;
+                pos = next;
+                continue;
+            }
+            if (data.size() - pos < 4)
+                break;
+
+            const auto channel = static_cast<uint8_t>(data[pos + 1]);
+            const size_t length = static_cast<uint8_t>(data[pos + 2]) << 8 | static_cast<uint8_t>(data[pos + 3]);
+            if (data.size() - pos < 4 + length)
+                break;
+
+            store.append(channel, data.substr(pos + 4, length), arrival);
+            pos += 4 + length;
+        }
+        return pos;
+    }
+
+    // Head and Content-Length bytes of body, 0 while the head isn't complete
+    static size_t responseSize(std::string_view data) {
+        auto end = data.find("\r\n\r\n");
+        if (end == std::string_view::npos)
+            return 0;
+        const size_t head = end + 4;
+        size_t body = 0;
+        auto length = util::findHeaderValue(data.substr(0, head), "Content-Length");
+        std::from_chars(length.data(), length.data() + length.size(), body);
+        return head + body;
+    }
+
+    std::string m_pending;
+    size_t m_skipped = 0;
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// PrefixIndex is a compressed (radix) trie over string keys.
+// It answers "which key is the longest prefix of this string" in O(length of the string),
+// regardless of how many keys it holds.
+// Nodes live in one vector and refer to each other by index, so the index is cheap to copy.
+template<typename T>
+class PrefixIndex
+{
+    struct Node
+    {
+        std::string label;
+        std::vector<uint32_t> children; // sorted by the first char of the child's label
+        std::optional<T> value;
+    };
+
+public:
+    PrefixIndex() :
+        m_nodes(1)
+    {}
+
+    void insert(std::string_view key, T value) {
+        uint32_t current = 0;
+        for (;;) {
+            if (key.empty()) {
+                m_nodes[current].value = std::move(value);
+                return;
+            }
+
+            auto childIt = lowerBound(current, key.front());
+            if (childIt == m_nodes[current].children.end() || m_nodes[*childIt].label.front() != key.front()) {
+                auto child = static_cast<uint32_t>(m_nodes.size());
+                m_nodes[current].children.insert(childIt, child);
+                m_nodes.push_back(Node{ std::string{ key }, {}, std::move(value) });
+                return;
+            }
+
+            const uint32_t child = *childIt;
+            const std::string_view label = m_nodes[child].label;
+            auto common = static_cast<size_t>(std::ranges::mismatch(label, key).in1 - label.begin());
+
+            if (common < label.size()) {
+                // split the edge: `child` keeps the common part, the rest moves into a new node
+                Node tail{ std::string{ label.substr(common) }, std::move(m_nodes[child].children), std::move(m_nodes[child].value) };
+                auto tailIdx = static_cast<uint32_t>(m_nodes.size());
+                m_nodes.push_back(std::move(tail));
+
+                auto& node = m_nodes[child];
+                node.label.resize(common);
+                node.children = { tailIdx };
+                node.value.reset();
+            }
+
+            key.remove_prefix(common);
+            current = child;
+        }
+    }
+
+    // Returns the value of the longest key that `str` starts with, or nullptr
+    const T* longestPrefix(std::string_view str) const {
+        const Node* node = &m_nodes.front();
+        const T* best = node->value ? &*node->value : nullptr;
+
+        while (!str.empty()) {
+            auto childIt = findChild(*node, str.front());
+            if (childIt == node->children.end())
+                break;
+
+            node = &m_nodes[*childIt];
+            if (!str.starts_with(node->label))
+                break;
+
+            str.remove_prefix(node->label.size());
+            if (node->value)
+                best = &*node->value;
+        }
+
+        return best;
+    }
+
+    bool isEmpty() const {
+        return m_nodes.size() == 1 && !m_nodes.front().value;
+    }
+
+private:
+    std::vector<uint32_t>::const_iterator findChild(const Node& node, char first) const {
+        auto it = std::ranges::lower_bound(node.children, first, {}, [this](uint32_t idx) { return m_nodes[idx].label.front(); });
+        if (it != node.children.end() && m_nodes[*it].label.front() != first)
+            return node.children.end();
+        return it;
+    }
+
+    std::vector<uint32_t>::iterator lowerBound(uint32_t nodeIdx, char first) {
+        auto& children = m_nodes[nodeIdx].children;
+        return std::ranges::lower_bound(children, first, {}, [this](uint32_t idx) { return m_nodes[idx].label.front(); });
+    }
+
+    std::vector<Node> m_nodes;
+};
@@ -1,8 +1,16 @@
 #pragma once
 
 #include "Utility.h"
-#include <fmt/core.h>
+#include "PacketStore.h"
+#include "Rtp.h"
+#include "WireLayout.h"
+
+#include <algorithm>
+#include <array>
+#include <optional>
 #include <span>
+#include <string>
+#include <vector>
 
 namespace Raysharp {
 
@@ -65,7 +73,7 @@ struct IVA_REPORT_RESULT_HEAD_S //tagIVAReportResultHead
     USHORT usDisplayHoldTime;  	    /* Continuous display time ms */
     UCHAR	ucExtHeadFlag:1;		/* if carry extended data */
     UCHAR	ucExtDataLenth:7;		/* Extended data length */
-	UCHAR	ucMDReserve[8];		    /* reserve */
+	UCHAR	ucMDReserve[6];		    /* reserve */
 };		/* Structure size: 16 bytes in total */
 
 /* Reported analysis results */
@@ -141,72 +149,323 @@ using IVA_REPORT_RULE_INFO_S = IVA_REPORT_RULE_INFO_V1_S;
 
 // -------------------------------------------//
 
-template<typename T>
-auto parseResultType(util::BitStream<T> bs, size_t length)
-    -> std::pair<util::BitStream<T>, IVA_REPORT_RESULT_HEAD_S>
-{
-    IVA_REPORT_RESULT_HEAD_S result_head;
-    result_head.usChannel = bs.pop(16);
-    result_head.ucEnable = bs.pop(8);
-    result_head.usTargetNum = bs.pop(16);
-    result_head.usPerTargetSz = bs.pop(16);
-    result_head.usDisplayHoldTime = bs.pop(16);
-    result_head.ucExtHeadFlag = bs.pop(1);
-    result_head.ucExtDataLenth = bs.pop(7);
-    std::copy(bs.position(), bs.position() + 8, result_head.ucMDReserve);
-    bs.skip(8);
-
-    if (result_head.ucExtHeadFlag) {
-        bs.skip(result_head.ucExtDataLenth * 8);
-        std::cout << "Skip extended data\n";
-    }
+constexpr uint8_t PAYLOAD_TYPE = 108;
+
+// "ucExtHeadFlag:1, ucExtDataLenth:7" byte of the headers
+template<typename Head>
+void decodeExtFlags(Head& head, const char* p)
+{
+    const auto flags = static_cast<uint8_t>(*p);
+    head.ucExtHeadFlag = flags >> 7;
+    head.ucExtDataLenth = flags & 0x7f;
+}
+
+}
+
+// Wire layouts of the packed structs, in declaration order. Adding a metadata version is adding a layout.
+template<> struct wire::LayoutOf<Raysharp::IVA_METADATA_MGR_HEAD_S>
+{
+    using S = Raysharp::IVA_METADATA_MGR_HEAD_S;
+    using type = wire::Layout<S, wire::Field<&S::ucMetaDataType>, wire::Field<&S::usMDHeadLenth>, wire::Field<&S::usMDBodyLenth>,
+        wire::Field<&S::ucProtocolVer>, wire::Field<&S::ucMDataBodyVer>, wire::Custom<1, &Raysharp::decodeExtFlags<S>>, wire::Skip<8>>;
+};
+
+template<> struct wire::LayoutOf<Raysharp::IVA_REPORT_COORD_S>
+{
+    using S = Raysharp::IVA_REPORT_COORD_S;
+    using type = wire::Layout<S, wire::Field<&S::usX>, wire::Field<&S::usY>>;
+};
+
+template<> struct wire::LayoutOf<Raysharp::IVA_REPORT_RESULT_HEAD_S>
+{
+    using S = Raysharp::IVA_REPORT_RESULT_HEAD_S;
+    using type = wire::Layout<S, wire::Field<&S::usChannel>, wire::Field<&S::ucEnable>, wire::Field<&S::usTargetNum>, wire::Field<&S::usPerTargetSz>,
+        wire::Field<&S::usDisplayHoldTime>, wire::Custom<1, &Raysharp::decodeExtFlags<S>>, wire::Skip<6>>;
+};
+
+template<> struct wire::LayoutOf<Raysharp::IVA_REPORT_RESULT_INFO_V1_S>
+{
+    using S = Raysharp::IVA_REPORT_RESULT_INFO_V1_S;
+    using type = wire::Layout<S, wire::Field<&S::ulTargetID>, wire::Field<&S::ulTrigRule>, wire::Field<&S::stStart>, wire::Field<&S::stEnd>,
+        wire::Field<&S::enLineColor>, wire::Field<&S::ulLineAlpha>, wire::Field<&S::ulTrailHoldTime>, wire::Field<&S::ulAttachLen>, wire::Field<&S::ulAttachType>>;
+};
+
+template<> struct wire::LayoutOf<Raysharp::IVA_REPORT_RULE_HEAD_S>
+{
+    using S = Raysharp::IVA_REPORT_RULE_HEAD_S;
+    using type = wire::Layout<S, wire::Field<&S::usChannel>, wire::Field<&S::ucEnable>, wire::Field<&S::usRuleNum>, wire::Field<&S::usPerTargetSz>,
+        wire::Field<&S::usDisplayHoldTime>, wire::Custom<1, &Raysharp::decodeExtFlags<S>>, wire::Skip<6>>;
+};
+
+template<> struct wire::LayoutOf<Raysharp::IVA_REPORT_RULE_INFO_V1_S>
+{
+    using S = Raysharp::IVA_REPORT_RULE_INFO_V1_S;
+    using type = wire::Layout<S, wire::Field<&S::ulRuleID>, wire::Field<&S::bTriggered>, wire::Field<&S::enRuleType>, wire::Field<&S::enTrigType>,
+        wire::Field<&S::astCoord>, wire::Field<&S::ulCoordNum>, wire::Field<&S::enLineColor>, wire::Field<&S::enFillColor>,
+        wire::Field<&S::ulLineAlpha>, wire::Field<&S::ulFillAlpha>, wire::Field<&S::ulAttachLen>, wire::Field<&S::ulAttachType>>;
+};
+
+namespace Raysharp {
+
+// The layouts must describe every byte of the packed structs and the sizes of the protocol
+static_assert(wire::sizeOf<IVA_METADATA_MGR_HEAD_S> == sizeof(IVA_METADATA_MGR_HEAD_S) && sizeof(IVA_METADATA_MGR_HEAD_S) == 16);
+static_assert(wire::sizeOf<IVA_REPORT_RESULT_HEAD_S> == sizeof(IVA_REPORT_RESULT_HEAD_S) && sizeof(IVA_REPORT_RESULT_HEAD_S) == 16);
+static_assert(wire::sizeOf<IVA_REPORT_RULE_HEAD_S> == sizeof(IVA_REPORT_RULE_HEAD_S) && sizeof(IVA_REPORT_RULE_HEAD_S) == 16);
+static_assert(wire::sizeOf<IVA_REPORT_RESULT_INFO_V1_S> == sizeof(IVA_REPORT_RESULT_INFO_V1_S) && sizeof(IVA_REPORT_RESULT_INFO_V1_S) == 36);
+static_assert(wire::sizeOf<IVA_REPORT_RULE_INFO_V1_S> == sizeof(IVA_REPORT_RULE_INFO_V1_S) && sizeof(IVA_REPORT_RULE_INFO_V1_S) == 108);
+
+// Where and when a metadata payload was captured
+struct Frame
+{
+    util::timestamp_us arrival = 0;
+    uint32_t rtpTimestamp = 0;
+};
+
+// Where the target records of a result payload are, for writers that patch them in place
+struct ResultLayout
+{
+    // offset of IVA_REPORT_RESULT_HEAD_S in the payload
+    size_t headOffset = 0;
+    size_t recordsOffset = 0;
+    uint16_t count = 0;
+    uint16_t stride = 0;
+};
+
+// Byte offsets of the fields a writer patches
+constexpr size_t MGR_BODY_LENGTH_OFFSET = 3;
+constexpr size_t RESULT_TARGET_NUM_OFFSET = 3;
+constexpr size_t RESULT_PER_TARGET_SZ_OFFSET = 5;
+constexpr size_t TARGET_ID_OFFSET = 0;
+constexpr size_t TARGET_START_OFFSET = 8;
+constexpr size_t TARGET_END_OFFSET = 12;
 
-    return {bs, result_head};
+// Nothing if the payload isn't a result or its records don't fit
+inline std::optional<ResultLayout> locateResults(std::span<const char> payload)
+{
+    auto header = wire::decode<IVA_METADATA_MGR_HEAD_S>(payload);
+    if (!header || header->ucMetaDataType != tagMetaDataType::META_DATA_TYPE_RESULT_V2)
+        return {};
+    ResultLayout layout;
+    layout.headOffset = wire::sizeOf<IVA_METADATA_MGR_HEAD_S> + (header->ucExtHeadFlag ? header->ucExtDataLenth : 0);
+    auto head = wire::decode<IVA_REPORT_RESULT_HEAD_S>(payload.subspan(std::min(layout.headOffset, payload.size())));
+    if (!head || head->usPerTargetSz < wire::sizeOf<IVA_REPORT_RESULT_INFO_V1_S>)
+        return {};
+
+    layout.recordsOffset = layout.headOffset
+        + std::max<size_t>(header->usMDHeadLenth, wire::sizeOf<IVA_REPORT_RESULT_HEAD_S> + (head->ucExtHeadFlag ? head->ucExtDataLenth : 0));
+    layout.count = head->usTargetNum;
+    layout.stride = head->usPerTargetSz;
+    if (payload.size() < layout.recordsOffset + size_t{ layout.count } * layout.stride)
+        return {};
+    return layout;
 }
 
-template<typename T>
-void parsedtPayload(util::BitStream<T> bs)
-{
-    IVA_METADATA_MGR_HEAD_S header {};
-    header.ucMetaDataType = bs.pop(8);
-    header.usMDHeadLenth = bs.pop(16);
-    header.usMDBodyLenth = bs.pop(16);
-    header.ucProtocolVer = bs.pop(8);
-    header.ucMDataBodyVer = bs.pop(8);
-    header.ucExtHeadFlag = bs.pop(1);
-    header.ucExtDataLenth = bs.pop(7);
-    std::copy(bs.position(), bs.position() + 8, header.ucMDReserve);
-    bs.skip(8);
-
-    if (header.ucExtHeadFlag) {
-        bs.skip(header.ucExtDataLenth * 8);
-        fmt::println("Skip extended data");
+// All targets of a stream as columns, one row per target per metadata packet
+struct Targets
+{
+    std::vector<util::timestamp_us> arrival;
+    std::vector<uint32_t> rtpTimestamp;
+    std::vector<uint16_t> channel;
+    std::vector<uint32_t> targetId;
+    // bit n - rule n is triggered
+    std::vector<uint32_t> ruleMask;
+    // bounding box, 0-10000
+    std::vector<uint16_t> startX;
+    std::vector<uint16_t> startY;
+    std::vector<uint16_t> endX;
+    std::vector<uint16_t> endY;
+    // IVA_REPORT_COLOR_E
+    std::vector<uint8_t> color;
+
+    size_t size() const {
+        return targetId.size();
     }
+};
 
-    switch (header.ucMetaDataType) {
-    case tagMetaDataType::META_DATA_TYPE_RESULT_V2:
+// All rules of a stream as columns; the polygon of rule i is coords[coordOffset[i], coordOffset[i] + coordCount[i])
+struct Rules
+{
+    std::vector<util::timestamp_us> arrival;
+    std::vector<uint32_t> rtpTimestamp;
+    std::vector<uint16_t> channel;
+    std::vector<uint32_t> ruleId;
+    std::vector<uint8_t> triggered;
+    // IVA_REPORT_RULE_TYPE_E
+    std::vector<uint8_t> ruleType;
+    // IVA_REPORT_TRIG_TYPE_E
+    std::vector<uint8_t> trigType;
+    std::vector<uint8_t> lineColor;
+    std::vector<uint8_t> fillColor;
+    std::vector<uint32_t> coordOffset;
+    std::vector<uint8_t> coordCount;
+    std::vector<IVA_REPORT_COORD_S> coords;
+
+    size_t size() const {
+        return ruleId.size();
+    }
+};
+
+// Decodes metadata payloads (the manager header + a result or rule body) of a stream into columns.
+// A payload that doesn't fit its declared sizes is counted as malformed; the targets/rules that fit are kept.
+class MetadataDecoder
+{
+public:
+    bool decode(std::span<const char> payload, Frame frame)
+    {
+        auto header = wire::decode<IVA_METADATA_MGR_HEAD_S>(payload);
+        if (!header)
+            return reject();
+        const size_t bodyOffset = wire::sizeOf<IVA_METADATA_MGR_HEAD_S> + (header->ucExtHeadFlag ? header->ucExtDataLenth : 0);
+        if (payload.size() < bodyOffset)
+            return reject();
+
+        auto body = payload.subspan(bodyOffset);
+        switch (header->ucMetaDataType) {
+        case tagMetaDataType::META_DATA_TYPE_RESULT_V2:
+            return decodeResults(body, header->usMDHeadLenth, frame) || reject();
+        case tagMetaDataType::META_DATA_TYPE_RULE_V2:
+            return decodeRules(body, header->usMDHeadLenth, frame) || reject();
+        default:
+            ++m_unknown;
+            return false;
+        }
+    }
+
+    const Targets& targets() const {
+        return m_targets;
+    }
+
+    const Rules& rules() const {
+        return m_rules;
+    }
+
+    size_t malformed() const {
+        return m_malformed;
+    }
+
+    // payloads with a metadata type other than results and rules
+    size_t unknown() const {
+        return m_unknown;
+    }
+
+private:
+    bool reject()
     {
-        fmt::println("META_DATA_TYPE_RESULT_V2");
-        fmt::println("usMDHeadLenth: {}", header.usMDHeadLenth);
-        fmt::println("usMDBodyLenth: {}", header.usMDBodyLenth);
-        fmt::println("ucProtocolVer: {}", header.ucProtocolVer);
-        fmt::println("ucMDataBodyVer: {}", header.ucMDataBodyVer);
-        auto [bs, result_head] = parseResultType(bs, header.usMDHeadLenth);
-        fmt::println("usChannel: {}", result_head.usChannel);
-        fmt::println("ucEnable: {}", result_head.ucEnable);
-        fmt::println("usTargetNum: {}", result_head.usPerTargetSz);
-        fmt::println("usDisplayHoldTime: {}", result_head.usDisplayHoldTime);
-        
-        //auto [bs, result] = parsedtPayload(bs);
-        break;
+        ++m_malformed;
+        return false;
     }
-    case tagMetaDataType::META_DATA_TYPE_RULE_V2:
-        std::cout << "META_DATA_TYPE_RULE_V2\n";
-        break;
-    default:
-        std::cout << "unknown type\n";
-        break;
+
+    // Records of a body follow its head: `headLength` bytes (usMDHeadLenth), but at least the head and its extension
+    template<typename Head>
+    static std::span<const char> records(std::span<const char> body, const Head& head, size_t headLength)
+    {
+        const size_t offset = std::max<size_t>(headLength, wire::sizeOf<Head> + (head.ucExtHeadFlag ? head.ucExtDataLenth : 0));
+        return body.size() < offset ? std::span<const char>{} : body.subspan(offset);
     }
+
+    bool decodeResults(std::span<const char> body, size_t headLength, Frame frame)
+    {
+        auto head = wire::decode<IVA_REPORT_RESULT_HEAD_S>(body);
+        // usPerTargetSz may be larger than V1 for newer versions, the fields after V1 are skipped
+        if (!head || head->usPerTargetSz < wire::sizeOf<IVA_REPORT_RESULT_INFO_V1_S>)
+            return false;
+
+        auto& t = m_targets;
+        auto decoded = wire::decodeEach<IVA_REPORT_RESULT_INFO_V1_S>(records(body, *head, headLength), head->usTargetNum, head->usPerTargetSz,
+            [&](const IVA_REPORT_RESULT_INFO_V1_S& target) {
+                t.arrival.push_back(frame.arrival);
+                t.rtpTimestamp.push_back(frame.rtpTimestamp);
+                t.channel.push_back(head->usChannel);
+                t.targetId.push_back(target.ulTargetID);
+                t.ruleMask.push_back(target.ulTrigRule);
+                t.startX.push_back(target.stStart.usX);
+                t.startY.push_back(target.stStart.usY);
+                t.endX.push_back(target.stEnd.usX);
+                t.endY.push_back(target.stEnd.usY);
+                t.color.push_back(static_cast<uint8_t>(target.enLineColor));
+            });
+        return decoded == head->usTargetNum;
+    }
+
+    bool decodeRules(std::span<const char> body, size_t headLength, Frame frame)
+    {
+        auto head = wire::decode<IVA_REPORT_RULE_HEAD_S>(body);
+        if (!head || head->usPerTargetSz < wire::sizeOf<IVA_REPORT_RULE_INFO_V1_S>)
+            return false;
+
+        auto& r = m_rules;
+        auto decoded = wire::decodeEach<IVA_REPORT_RULE_INFO_V1_S>(records(body, *head, headLength), head->usRuleNum, head->usPerTargetSz,
+            [&](const IVA_REPORT_RULE_INFO_V1_S& rule) {
+                const auto coordNum = std::min<size_t>(rule.ulCoordNum, IVA_REPORT_COORD_NUM);
+                r.arrival.push_back(frame.arrival);
+                r.rtpTimestamp.push_back(frame.rtpTimestamp);
+                r.channel.push_back(head->usChannel);
+                r.ruleId.push_back(rule.ulRuleID);
+                r.triggered.push_back(rule.bTriggered != 0);
+                r.ruleType.push_back(static_cast<uint8_t>(rule.enRuleType));
+                r.trigType.push_back(static_cast<uint8_t>(rule.enTrigType));
+                r.coordOffset.push_back(static_cast<uint32_t>(r.coords.size()));
+                r.coordCount.push_back(static_cast<uint8_t>(coordNum));
+                r.coords.insert(r.coords.end(), rule.astCoord, rule.astCoord + coordNum);
+                r.lineColor.push_back(static_cast<uint8_t>(rule.enLineColor));
+                r.fillColor.push_back(static_cast<uint8_t>(rule.enFillColor));
+            });
+        return decoded == head->usRuleNum;
+    }
+
+    Targets m_targets;
+    Rules m_rules;
+    size_t m_malformed = 0;
+    size_t m_unknown = 0;
+};
+
+// Decodes every metadata packet of a recorded stream.
+// A payload split over several RTP packets (same timestamp, marker on the last) is joined first,
+// a payload in one packet is decoded in place. The rows are appended to what `decoder` already has.
+inline void decodeStream(const PacketStore& store, MetadataDecoder& decoder, uint8_t payloadType = PAYLOAD_TYPE)
+{
+    std::string joined;
+    std::optional<rtp::Header> first;
+    Frame frame;
+
+    auto flush = [&] {
+        if (first && !joined.empty())
+            decoder.decode(joined, frame);
+        else if (first)
+            decoder.decode(first->payload, frame);
+        first.reset();
+        joined.clear();
+    };
+
+    for (auto&& packet : store.packets()) {
+        if (!PacketStore::isRtp(packet.channel))
+            continue;
+        auto header = rtp::parseHeader(store.data(packet));
+        if (!header || header->payloadType != payloadType)
+            continue;
+
+        if (first && header->timestamp != first->timestamp)
+            flush();
+        if (!first) {
+            first = header;
+            frame = { packet.arrival, header->timestamp };
+        }
+        else {
+            if (joined.empty())
+                joined.assign(first->payload);
+            joined.append(header->payload);
+        }
+        if (header->marker)
+            flush();
+    }
+    flush();
+}
+
+inline MetadataDecoder decodeStream(const PacketStore& store, uint8_t payloadType = PAYLOAD_TYPE)
+{
+    MetadataDecoder decoder;
+    decodeStream(store, decoder, payloadType);
+    return decoder;
 }
 
 }
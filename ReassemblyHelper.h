@@ -3,8 +3,14 @@
 #include <TcpReassembly.h>
 
 #include "Http.h"
+#include "Rtsp.h"
+#include "H26x.h"
 #include "Generator.h"
+#include "PrefixIndex.h"
+#include "RequestFingerprint.h"
 #include <functional>
+#include <atomic>
+#include <unordered_map>
 
 // flowkey, request
 using http_requests_t = std::map<uint32_t, RequestResponse>;
@@ -12,61 +18,306 @@ using rtsp_stream_t = std::map<uint32_t, PrepareRtspStream>;
 
 using http_requests_vec_t = std::vector<RequestResponse>;
 
-using http_requests_map_t = std::map<std::string_view, http_requests_vec_t>;
 using rtsp_stream_map_t = std::map<std::string, RtspStream>;
-using rtsp_stream_map_SP_t = std::shared_ptr<rtsp_stream_map_t>;
 
+// All recorded RTSP streams plus a prefix index over their URIs.
+// A request URI (e.g. "/cam1/trackID=1") is served by the stream with the longest matching URI.
+struct RtspStreamCatalog
+{
+    rtsp_stream_map_t streams;
+    PrefixIndex<const RtspStream*> index;
+    // how much the responses of equal steps were deduplicated by finalize()
+    ContentStore::Stats sharing;
+
+    RtspStreamCatalog() = default;
+    // the index points into `streams`
+    RtspStreamCatalog(const RtspStreamCatalog&) = delete;
+    RtspStreamCatalog& operator=(const RtspStreamCatalog&) = delete;
+
+    // Must be called once all streams are added: shares equal step responses (a reconnecting client's OPTIONS, DESCRIBE...),
+    // sorts the packets of every stream by arrival and indexes its keyframes.
+    // Streams loaded from a bundle are already sorted and have their keyframes, `findKeyframes` is false then.
+    void finalize(bool findKeyframes = true) {
+        index = {};
+        ContentStore contents;
+        for (auto&& [uri, stream] : streams) {
+            index.insert(uri, &stream);
+            for (auto& step : stream.m_steps) {
+                step.share(contents);
+            }
+            if (!findKeyframes)
+                continue;
+            stream.m_packets.sortByArrival();
+            stream.m_keyframes = h26x::keyframePackets(stream.m_packets, stream.sdp());
+        }
+        sharing = contents.stats();
+    }
+
+    const RtspStream* find(std::string_view uri) const {
+        auto stream = index.longestPrefix(uri);
+        return stream ? *stream : nullptr;
+    }
+
+    // Virtual cameras "<prefix><N>" for N in [first, first + count) that all replay one recorded stream
+    struct FanOut
+    {
+        std::string prefix;
+        uint32_t first = 0;
+        uint32_t count = 0;
+        const RtspStream* stream = nullptr;
+    };
+
+    struct Resolved
+    {
+        const RtspStream* stream = nullptr;
+        // number of the virtual camera, nothing for a recorded URI
+        std::optional<uint32_t> camera;
+    };
+
+    // "/cam{0..999}=/recorded/uri" exposes the recording under /cam0 ... /cam999,
+    // without "=<uri>" the first recorded stream is used. Returns false if the spec is malformed.
+    bool addFanOut(std::string_view spec) {
+        auto eq = spec.find('=');
+        auto pattern = spec.substr(0, eq);
+        auto open = pattern.find('{');
+        auto dots = pattern.find("..");
+        if (open == std::string_view::npos || dots == std::string_view::npos || !pattern.ends_with('}') || dots < open)
+            return false;
+
+        FanOut fanOut{ std::string{ pattern.substr(0, open) } };
+        auto first = pattern.substr(open + 1, dots - open - 1);
+        auto last = pattern.substr(dots + 2, pattern.size() - dots - 3);
+        auto isNumber = [](std::string_view s) { return !s.empty() && std::ranges::all_of(s, [](char c) { return c >= '0' && c <= '9'; }); };
+        if (fanOut.prefix.empty() || !isNumber(first) || !isNumber(last))
+            return false;
+        fanOut.first = static_cast<uint32_t>(PatternSeeker(first).takeUInt64(0));
+        const auto lastNumber = static_cast<uint32_t>(PatternSeeker(last).takeUInt64(0));
+        if (lastNumber < fanOut.first)
+            return false;
+        fanOut.count = lastNumber - fanOut.first + 1;
+
+        if (eq == std::string_view::npos) {
+            fanOut.stream = streams.empty() ? nullptr : &streams.begin()->second;
+        }
+        else {
+            auto it = streams.find(std::string{ spec.substr(eq + 1) });
+            fanOut.stream = it == streams.end() ? nullptr : &it->second;
+        }
+        if (!fanOut.stream)
+            return false;
 
-struct ReqResHolder
+        fanOutIndex.insert(fanOut.prefix, static_cast<uint32_t>(fanOuts.size()));
+        fanOuts.push_back(std::move(fanOut));
+        return true;
+    }
+
+    // A virtual camera URI (e.g. "/cam17/trackID=1") if it's one, otherwise the recorded stream
+    Resolved resolve(std::string_view uri) const {
+        if (auto idx = fanOutIndex.longestPrefix(uri)) {
+            const auto& fanOut = fanOuts[*idx];
+            auto rest = uri.substr(fanOut.prefix.size());
+            auto digits = rest.substr(0, rest.find_first_not_of("0123456789"));
+            const bool isEnd = digits.size() == rest.size() || rest[digits.size()] == '/';
+            if (!digits.empty() && isEnd) {
+                const auto number = PatternSeeker(digits).takeUInt64(UINT64_MAX);
+                if (number >= fanOut.first && number - fanOut.first < fanOut.count)
+                    return { fanOut.stream, static_cast<uint32_t>(number) };
+            }
+        }
+        return { find(uri) };
+    }
+
+    std::vector<FanOut> fanOuts;
+    PrefixIndex<uint32_t> fanOutIndex;
+};
+using rtsp_stream_map_SP_t = std::shared_ptr<RtspStreamCatalog>;
+
+
+// How the recorded HTTP exchanges are turned into the catalog
+struct CatalogOptions
+{
+    FingerprintConfig fingerprint;
+    // bodies larger than inlineBodyLimit are moved into this file, empty - keep everything in memory
+    std::string bodyStorePath;
+    // the body store file is removed when the catalog is
+    bool isBodyStoreTemporary = false;
+    size_t inlineBodyLimit = 1024 * 1024;
+    // media packets of every RTSP stream are also written here as "<uri>.dump", empty - no dumps
+    std::string dumpDirectory;
+};
+
+// Read-only index of the recorded HTTP exchanges by request fingerprint, built once.
+// Lookups don't allocate and can be done from any number of threads;
+// equal requests are answered round-robin with an atomic cursor per fingerprint.
+// If there's no exact match, the recorded request with the same method and path
+// that has the most parts in common with the live one is taken.
+class ReqResHolder
 {
-    ReqResHolder(http_requests_map_t map) {
-        for (auto&& [uri, http] : map) {
-            m_uris[uri] = helper{ http };
+public:
+    explicit ReqResHolder(http_requests_vec_t requests, FingerprintConfig config = {}, std::shared_ptr<const BodyStore> bodyStore = {},
+        ContentStore::Stats sharing = {}) :
+        m_requests(std::move(requests)),
+        m_fingerprinter(std::move(config)),
+        m_bodyStore(std::move(bodyStore)),
+        m_sharing(sharing)
+    {
+        m_index.reserve(m_requests.size());
+        for (auto&& reqres : m_requests) {
+            auto& request = reqres.request;
+            auto header = [&request](std::string_view name) { return request.header(name); };
+            auto fp = m_fingerprinter(request.method(), request.uri(), header, request.body());
+
+            auto& entry = m_index[fp.full];
+            if (entry.responses.empty()) {
+                entry.fingerprint = fp;
+                m_routes[fp.route()].push_back(&entry);
+            }
+            entry.responses.push_back(&reqres);
         }
     }
-    struct helper {
-        std::vector<RequestResponse> vec{};
-        uint32_t i = 0;
 
-        const RequestResponse& getNextReqRes() {
-            return vec[i++ % vec.size()];
+    ReqResHolder(const ReqResHolder&) = delete;
+    ReqResHolder& operator=(const ReqResHolder&) = delete;
+
+    // The next recorded exchange for this request or nullptr if nothing like it was recorded.
+    // `header(name)` returns the value of a header of the live request.
+    template<typename HeaderGetter>
+    const RequestResponse* find(std::string_view method, std::string_view target, HeaderGetter&& header, std::string_view body) const {
+        auto fp = m_fingerprinter(method, target, header, body);
+
+        auto it = m_index.find(fp.full);
+        if (it != m_index.end())
+            return it->second.next();
+
+        auto route = m_routes.find(fp.route());
+        if (route == m_routes.end())
+            return nullptr;
+
+        const Entry* nearest = nullptr;
+        int bestScore = -1;
+        for (auto* entry : route->second) {
+            auto& candidate = entry->fingerprint;
+            int score = (candidate.query == fp.query) * 4 + (candidate.body == fp.body) * 2 + (candidate.headers == fp.headers);
+            if (score > bestScore) {
+                bestScore = score;
+                nearest = entry;
+            }
         }
-    };
+        return nearest->next();
+    }
+
+    size_t size() const {
+        return m_requests.size();
+    }
 
-    const RequestResponse& operator[](std::string_view str) {
-        return m_uris[str].getNextReqRes();
+    const http_requests_vec_t& requests() const {
+        return m_requests;
     }
 
-    std::map<std::string_view, helper> m_uris;
+    // How much the bytes of equal requests and responses were deduplicated
+    const ContentStore::Stats& sharing() const {
+        return m_sharing;
+    }
+
+    // Where the bodies of responses with m_storedBody are, null if none were stored
+    const BodyStore* bodyStore() const {
+        return m_bodyStore.get();
+    }
+
+private:
+    struct Entry
+    {
+        Fingerprint fingerprint;
+        std::vector<const RequestResponse*> responses;
+        mutable std::atomic<uint32_t> cursor{ 0 };
+
+        const RequestResponse* next() const {
+            auto i = cursor.fetch_add(1, std::memory_order_relaxed);
+            return responses[i % responses.size()];
+        }
+    };
+
+    http_requests_vec_t m_requests;
+    RequestFingerprinter m_fingerprinter;
+    std::shared_ptr<const BodyStore> m_bodyStore;
+    ContentStore::Stats m_sharing;
+    // fingerprint -> recorded exchanges
+    std::unordered_map<uint64_t, Entry> m_index;
+    // method + path -> entries, for the nearest match
+    std::unordered_map<uint64_t, std::vector<const Entry*>> m_routes;
 };
 using req_res_holder_SP_t = std::shared_ptr<ReqResHolder>;
 
+// The HTTP catalog of parsed exchanges: the ones that failed to parse are skipped,
+// large bodies are moved to the body store if the options ask for it
+inline req_res_holder_SP_t makeHttpCatalog(http_requests_vec_t exchanges, const CatalogOptions& options) {
+    std::shared_ptr<BodyStore> bodyStore;
+    if (!options.bodyStorePath.empty())
+        bodyStore = std::make_shared<BodyStore>(options.bodyStorePath, options.isBodyStoreTemporary);
+
+    // equal requests and responses of polling clients keep one copy of their bytes
+    ContentStore contents;
+    http_requests_vec_t reqs;
+    reqs.reserve(exchanges.size());
+    for (auto&& reqres : exchanges) {
+        if (reqres.request.method().empty() || !reqres.response.isPrepared())
+            continue;
+        reqs.push_back(std::move(reqres));
+        reqs.back().request.share(contents);
+        auto& response = reqs.back().response;
+        if (bodyStore && response.m_body.size() > options.inlineBodyLimit)
+            response.storeBody(*bodyStore);
+        response.share(contents);
+    }
+    if (bodyStore)
+        bodyStore->seal();
+
+    return std::make_shared<ReqResHolder>(std::move(reqs), options.fingerprint, std::move(bodyStore), contents.stats());
+}
+
 class ReassemblyHelper
 {
     http_requests_t http_requests;
     rtsp_stream_t rtspStreams;
 
+    // where the datagrams from the server's address and port to the client's go
+    struct UdpRoute
+    {
+        std::string serverIp;
+        std::string clientIp;
+        uint32_t flowKey;
+        uint8_t channel;
+    };
+    // by (server port, client port): the addresses are only compared for datagrams on a negotiated port pair
+    std::unordered_map<uint32_t, std::vector<UdpRoute>> udpRoutes;
+    std::string dumpDirectory;
+
 public:
-    req_res_holder_SP_t getHttpRequests() {
-        http_requests_map_t reqs;
-        for (auto&& http : http_requests) {
-            auto& req = reqs[http.second.request.uri()];
-            req.push_back(http.second);
-        }
+    // Streams that start after this call write dumps of their packets into `directory`
+    void dumpTo(std::string directory) {
+        dumpDirectory = std::move(directory);
+    }
 
-        return std::make_shared<ReqResHolder>(reqs);
+    req_res_holder_SP_t getHttpRequests(const CatalogOptions& options = {}) {
+        http_requests_vec_t reqs;
+        reqs.reserve(http_requests.size());
+        for (auto&& [flowKey, reqres] : http_requests) {
+            reqs.push_back(reqres);
+        }
+        return makeHttpCatalog(std::move(reqs), options);
     }
 
     rtsp_stream_map_SP_t getRtspStreams() {
-        auto streams = std::make_shared<rtsp_stream_map_t>();
+        auto catalog = std::make_shared<RtspStreamCatalog>();
         for (auto&& [flowKey, stream] : rtspStreams) {
-            auto uri = stream.getStream().m_uri;
-            if (uri.empty())
+            if (stream.uri().empty())
                 continue;
-            (*streams)[uri] = stream.getStream();
+            auto uri = stream.uri();
+            catalog->streams[uri] = stream.takeStream();
         }
+        catalog->finalize();
 
-        return streams;
+        return catalog;
     }
 
     void onTcpMessageReady(int8_t side, const pcpp::TcpStreamData& tcpData) {
@@ -82,12 +333,34 @@ public:
         }
     }
 
+    // A UDP datagram of the capture. Only RTP/RTCP the server sends from the address and port
+    // negotiated by an earlier SETUP to the client's is kept. `addresses()` returns the source and destination IPs,
+    // it's only called for datagrams on a negotiated port pair, everything else is dropped without allocating.
+    template<typename AddressGetter>
+    void onUdpPacket(uint16_t srcPort, uint16_t dstPort, AddressGetter&& addresses, std::string_view payload, util::timestamp_us arrival) {
+        auto routes = udpRoutes.find(portPair(srcPort, dstPort));
+        if (routes == udpRoutes.end())
+            return;
+        const auto [srcIp, dstIp] = addresses();
+        auto route = std::ranges::find_if(routes->second, [&srcIp, &dstIp](const UdpRoute& route) {
+            return route.serverIp == srcIp && route.clientIp == dstIp;
+        });
+        if (route == routes->second.end())
+            return;
+        auto stream = rtspStreams.find(route->flowKey);
+        if (stream == rtspStreams.end())
+            return;
+        stream->second.addDatagram(route->channel, payload, arrival);
+    }
+
     void onTcpConnectionStart(const pcpp::ConnectionData& connData) {
         if (util::isHttpPort(connData)) {
             http_requests.emplace(connData.flowKey, RequestResponse{});
         }
         else if (util::isRtspPort(connData)) {
-            rtspStreams.emplace(connData.flowKey, PrepareRtspStream{});
+            auto [stream, isNew] = rtspStreams.emplace(connData.flowKey, PrepareRtspStream{});
+            if (isNew && !dumpDirectory.empty())
+                stream->second.dumpTo(dumpDirectory);
         }
         else {
             // Determine who opened connection
@@ -135,9 +408,32 @@ private:
         }
 	}
     void parseRtsp(int8_t side, const pcpp::TcpStreamData& tcpData) {
-        auto& rtspStream = rtspStreams[tcpData.getConnectionData().flowKey];
+        const auto& connData = tcpData.getConnectionData();
+        const auto flowKey = connData.flowKey;
+        auto& rtspStream = rtspStreams[flowKey];
         std::string data{ reinterpret_cast<const char*>(tcpData.getData()), tcpData.getDataLength() };
         bool isRequest = side == 0;
-        rtspStream.parseRstp(data, isRequest);
+        const auto udpTracks = rtspStream.udpTracks().size();
+        rtspStream.parseRstp(data, isRequest, util::convertToTimestampUs(tcpData.getTimeStamp()));
+
+        if (udpTracks == rtspStream.udpTracks().size())
+            return;
+        // a SETUP with client_port: the camera's datagrams from its address and port to the client's belong to this stream;
+        // a later SETUP between the same addresses and ports takes them over
+        const bool isServerSource = connData.srcPort == 554;
+        auto serverIp = (isServerSource ? connData.srcIP : connData.dstIP).toString();
+        auto clientIp = (isServerSource ? connData.dstIP : connData.srcIP).toString();
+        for (size_t i = udpTracks; i < rtspStream.udpTracks().size(); ++i) {
+            const auto& track = rtspStream.udpTracks()[i];
+            auto& routes = udpRoutes[portPair(track.serverPort, track.clientPort)];
+            std::erase_if(routes, [&serverIp, &clientIp](const UdpRoute& route) {
+                return route.serverIp == serverIp && route.clientIp == clientIp;
+            });
+            routes.push_back(UdpRoute{ serverIp, clientIp, flowKey, track.channel });
+        }
+    }
+
+    static uint32_t portPair(uint16_t serverPort, uint16_t clientPort) {
+        return static_cast<uint32_t>(serverPort) << 16 | clientPort;
     }
 };
\ No newline at end of file
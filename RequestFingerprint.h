@@ -0,0 +1,158 @@
+#pragma once
+
+#include "Utility.h"
+
+#include <algorithm>
+#include <cctype>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Which parts of an HTTP request identify it when a live request is matched with the recorded ones
+struct FingerprintConfig
+{
+    bool method = true;
+    // query parameters taken into account, empty - all of them
+    std::vector<std::string> queryParams;
+    // header values taken into account (names are case-insensitive)
+    std::vector<std::string> headers;
+    bool body = true;
+};
+
+// Hashes of every part of a request; `full` is what requests are looked up by,
+// the parts are compared to find the nearest recorded request when there's no exact match.
+struct Fingerprint
+{
+    uint64_t method = 0;
+    uint64_t path = 0;
+    uint64_t query = 0;
+    uint64_t headers = 0;
+    uint64_t body = 0;
+    uint64_t full = 0;
+
+    // method + path: the candidates for the nearest match
+    uint64_t route() const {
+        return util::hash64({}, method ^ (path * 0x9E3779B97F4A7C15ULL));
+    }
+};
+
+class RequestFingerprinter
+{
+public:
+    explicit RequestFingerprinter(FingerprintConfig config = {}) :
+        m_config(std::move(config))
+    {}
+
+    const FingerprintConfig& config() const {
+        return m_config;
+    }
+
+    // `header(name)` returns the value of a request header or an empty view
+    template<typename HeaderGetter>
+    Fingerprint operator()(std::string_view method, std::string_view target, HeaderGetter&& header, std::string_view body) const {
+        Fingerprint fp;
+        auto question = target.find('?');
+        auto path = target.substr(0, question);
+        auto query = question == std::string_view::npos ? std::string_view{} : target.substr(question + 1);
+
+        fp.method = m_config.method ? util::hash64(method) : 0;
+        fp.path = hashPath(path);
+        fp.query = hashQuery(query);
+        for (size_t i = 0; i < m_config.headers.size(); ++i) {
+            fp.headers = util::hash64(util::trim(std::string_view{ header(m_config.headers[i]) }), fp.headers + i);
+        }
+        fp.body = m_config.body ? util::hash64(body) : 0;
+
+        fp.full = fp.route();
+        for (uint64_t part : { fp.query, fp.headers, fp.body }) {
+            fp.full = util::hash64({}, fp.full ^ part);
+        }
+        return fp;
+    }
+
+private:
+    // Hash of bytes fed one at a time: they're packed into 64-bit words that are mixed as they fill,
+    // so the result is the same however the input is produced
+    class StreamHash
+    {
+    public:
+        void put(char ch) {
+            m_word |= static_cast<uint64_t>(static_cast<uint8_t>(ch)) << (8 * (m_size % 8));
+            if (++m_size % 8 == 0) {
+                m_hash = util::hash64({}, m_hash ^ m_word);
+                m_word = 0;
+            }
+        }
+
+        uint64_t result() const {
+            return util::hash64({}, util::hash64({}, m_hash ^ m_word) + m_size);
+        }
+
+    private:
+        uint64_t m_hash = 0;
+        uint64_t m_word = 0;
+        uint64_t m_size = 0;
+    };
+
+    // The path is normalized while it's hashed: repeated and trailing slashes are dropped,
+    // %XX escapes of unreserved characters are decoded. Nothing is allocated.
+    static uint64_t hashPath(std::string_view path) {
+        StreamHash hash;
+        bool isEmpty = true;
+        // a slash is only written when something follows it
+        bool hasSlash = false;
+        for (size_t i = 0; i < path.size(); ++i) {
+            char ch = path[i];
+            if (ch == '/') {
+                hasSlash = true;
+                continue;
+            }
+            if (ch == '%' && i + 2 < path.size() && hexValue(path[i + 1]) >= 0 && hexValue(path[i + 2]) >= 0) {
+                auto decoded = static_cast<char>(hexValue(path[i + 1]) * 16 + hexValue(path[i + 2]));
+                if (std::isalnum(static_cast<unsigned char>(decoded)) || decoded == '-' || decoded == '.' || decoded == '_' || decoded == '~') {
+                    ch = decoded;
+                    i += 2;
+                }
+            }
+            if (hasSlash)
+                hash.put('/');
+            hasSlash = false;
+            hash.put(ch);
+            isEmpty = false;
+        }
+        // the root stays "/"
+        if (hasSlash && isEmpty)
+            hash.put('/');
+        return hash.result();
+    }
+
+    static int hexValue(char ch) {
+        if (ch >= '0' && ch <= '9')
+            return ch - '0';
+        if (ch >= 'a' && ch <= 'f')
+            return ch - 'a' + 10;
+        if (ch >= 'A' && ch <= 'F')
+            return ch - 'A' + 10;
+        return -1;
+    }
+
+    // Order of the parameters doesn't matter: the hashes of "name=value" pairs are summed
+    uint64_t hashQuery(std::string_view query) const {
+        uint64_t hash = 0;
+        while (!query.empty()) {
+            auto amp = query.find('&');
+            auto param = query.substr(0, amp);
+            query = amp == std::string_view::npos ? std::string_view{} : query.substr(amp + 1);
+            if (param.empty())
+                continue;
+
+            auto name = param.substr(0, param.find('='));
+            if (!m_config.queryParams.empty() && std::ranges::find(m_config.queryParams, name) == m_config.queryParams.end())
+                continue;
+            hash += util::hash64(param);
+        }
+        return hash;
+    }
+
+    FingerprintConfig m_config;
+};
@@ -0,0 +1,311 @@
+#pragma once
+
+#include "PacketStore.h"
+#include "Rtp.h"
+#include "RtpAnalyzer.h"
+#include "Utility.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace rtcp {
+
+enum PacketType : uint8_t
+{
+    SR = 200,
+    RR = 201,
+    SDES = 202,
+    BYE = 203,
+    APP = 204,
+};
+
+constexpr size_t HEADER_SIZE = 4;
+constexpr size_t REPORT_BLOCK_SIZE = 24;
+// seconds between 1900-01-01 (NTP epoch) and 1970-01-01
+constexpr uint64_t NTP_UNIX_OFFSET = 2208988800ULL;
+
+// One packet of a compound packet. `body` follows the 4-byte header, padding is removed.
+struct Packet
+{
+    uint8_t type = 0;
+    // reception report count, SDES chunk count or BYE source count
+    uint8_t count = 0;
+    std::string_view body;
+};
+
+// Calls f(const Packet&) for every packet of a compound RTCP packet (RFC 3550, 6.1).
+// Returns false if the compound is malformed, the packets before the error are still visited.
+template<typename F>
+bool forEachPacket(std::string_view compound, F&& f) {
+    while (!compound.empty()) {
+        if (compound.size() < HEADER_SIZE)
+            return false;
+        const auto b0 = static_cast<uint8_t>(compound[0]);
+        if (b0 >> 6 != rtp::VERSION)
+            return false;
+        const size_t size = (rtp::load16(compound.data() + 2) + 1) * 4;
+        if (compound.size() < size)
+            return false;
+
+        Packet packet{ static_cast<uint8_t>(compound[1]), static_cast<uint8_t>(b0 & 0x1f), compound.substr(HEADER_SIZE, size - HEADER_SIZE) };
+        if (b0 & 0x20) {
+            const size_t padding = static_cast<uint8_t>(compound[size - 1]);
+            if (padding > packet.body.size())
+                return false;
+            packet.body.remove_suffix(padding);
+        }
+        f(packet);
+        compound.remove_prefix(size);
+    }
+    return true;
+}
+
+// Reception report block of SR and RR (RFC 3550, 6.4.1)
+struct ReportBlock
+{
+    uint32_t ssrc = 0;
+    uint8_t fractionLost = 0;
+    int32_t cumulativeLost = 0;
+    uint32_t highestSequence = 0;
+    uint32_t jitter = 0;
+    uint32_t lastSr = 0;
+    uint32_t delaySinceLastSr = 0;
+};
+
+inline ReportBlock parseReportBlock(const char* p) {
+    ReportBlock block;
+    block.ssrc = rtp::load32(p);
+    block.fractionLost = static_cast<uint8_t>(p[4]);
+    // 24-bit signed
+    const uint32_t lost = rtp::load32(p + 4) & 0xffffff;
+    block.cumulativeLost = static_cast<int32_t>(lost << 8) >> 8;
+    block.highestSequence = rtp::load32(p + 8);
+    block.jitter = rtp::load32(p + 12);
+    block.lastSr = rtp::load32(p + 16);
+    block.delaySinceLastSr = rtp::load32(p + 20);
+    return block;
+}
+
+// SR and RR. The report blocks aren't decoded until asked for.
+struct Report
+{
+    uint32_t ssrc = 0;
+    // sender info, SR only
+    bool isSender = false;
+    uint64_t ntp = 0;
+    uint32_t rtpTimestamp = 0;
+    uint32_t packetCount = 0;
+    uint32_t octetCount = 0;
+
+    std::string_view blocks;
+
+    size_t blockCount() const {
+        return blocks.size() / REPORT_BLOCK_SIZE;
+    }
+
+    ReportBlock block(size_t i) const {
+        return parseReportBlock(blocks.data() + i * REPORT_BLOCK_SIZE);
+    }
+
+    // Sender's wallclock in microseconds since the Unix epoch.
+    // Nothing if the NTP timestamp isn't a wallclock (0 or the uptime, as many cameras send)
+    std::optional<util::timestamp_us> wallclock() const {
+        if (ntp >> 32 < NTP_UNIX_OFFSET)
+            return {};
+        const uint64_t seconds = (ntp >> 32) - NTP_UNIX_OFFSET;
+        const uint64_t fraction = ntp & 0xffffffff;
+        return seconds * 1'000'000 + (fraction * 1'000'000 >> 32);
+    }
+};
+
+inline std::optional<Report> parseReport(const Packet& packet) {
+    if (packet.type != SR && packet.type != RR)
+        return {};
+
+    Report report;
+    report.isSender = packet.type == SR;
+    const size_t fixed = report.isSender ? 24 : 4;
+    if (packet.body.size() < fixed + packet.count * REPORT_BLOCK_SIZE)
+        return {};
+
+    const char* p = packet.body.data();
+    report.ssrc = rtp::load32(p);
+    if (report.isSender) {
+        report.ntp = static_cast<uint64_t>(rtp::load32(p + 4)) << 32 | rtp::load32(p + 8);
+        report.rtpTimestamp = rtp::load32(p + 12);
+        report.packetCount = rtp::load32(p + 16);
+        report.octetCount = rtp::load32(p + 20);
+    }
+    report.blocks = packet.body.substr(fixed, packet.count * REPORT_BLOCK_SIZE);
+    return report;
+}
+
+// Calls f(ssrc, type, value) for every SDES item (RFC 3550, 6.5), e.g. type 1 - CNAME
+template<typename F>
+bool forEachSdesItem(const Packet& packet, F&& f) {
+    if (packet.type != SDES)
+        return false;
+    std::string_view body = packet.body;
+    for (size_t chunk = 0; chunk < packet.count; ++chunk) {
+        if (body.size() < 4)
+            return false;
+        const uint32_t ssrc = rtp::load32(body.data());
+        size_t pos = 4;
+        // items end with a zero type, the chunk is padded to 32 bits
+        while (pos < body.size() && body[pos] != 0) {
+            if (body.size() - pos < 2)
+                return false;
+            const auto type = static_cast<uint8_t>(body[pos]);
+            const size_t length = static_cast<uint8_t>(body[pos + 1]);
+            if (body.size() - pos - 2 < length)
+                return false;
+            f(ssrc, type, body.substr(pos + 2, length));
+            pos += 2 + length;
+        }
+        pos = (pos + 4) & ~size_t{ 3 };
+        body.remove_prefix(std::min(pos, body.size()));
+    }
+    return true;
+}
+
+// Sources leaving the session and the optional reason
+struct Bye
+{
+    std::string_view ssrcs;
+    std::string_view reason;
+
+    size_t size() const {
+        return ssrcs.size() / 4;
+    }
+
+    uint32_t ssrc(size_t i) const {
+        return rtp::load32(ssrcs.data() + i * 4);
+    }
+};
+
+inline std::optional<Bye> parseBye(const Packet& packet) {
+    if (packet.type != BYE || packet.body.size() < packet.count * 4u)
+        return {};
+    Bye bye{ packet.body.substr(0, packet.count * 4u) };
+    auto rest = packet.body.substr(packet.count * 4u);
+    if (!rest.empty() && rest.size() > static_cast<uint8_t>(rest[0]))
+        bye.reason = rest.substr(1, static_cast<uint8_t>(rest[0]));
+    return bye;
+}
+
+// RTP timestamp -> sender wallclock of every SSRC, from the sender reports of a recording.
+// A lookup takes the report received closest before the packet (binary search by arrival time)
+// and extrapolates with the clock rate, so wraparound of the RTP timestamp doesn't matter.
+class ClockIndex
+{
+public:
+    struct SenderReport
+    {
+        util::timestamp_us arrival;
+        uint32_t rtpTimestamp;
+        util::timestamp_us wallclock;
+    };
+
+    // A report without a wallclock (see Report::wallclock()) can't map anything and is skipped
+    void add(uint32_t ssrc, const Report& report, util::timestamp_us arrival) {
+        auto wallclock = report.wallclock();
+        if (!wallclock)
+            return;
+        m_sources[ssrc].reports.push_back({ arrival, report.rtpTimestamp, *wallclock });
+    }
+
+    void setClockRate(uint32_t ssrc, uint32_t clockRate) {
+        m_sources[ssrc].clockRate = clockRate;
+    }
+
+    // Sorts the reports and estimates the clock rate of the sources it isn't known for
+    void finalize() {
+        for (auto&& [ssrc, source] : m_sources) {
+            std::ranges::sort(source.reports, {}, &SenderReport::arrival);
+            if (source.clockRate == 0)
+                source.clockRate = estimateClockRate(source.reports);
+        }
+    }
+
+    // Wallclock (µs since the Unix epoch) of the RTP timestamp of a packet that arrived at `arrival`
+    std::optional<util::timestamp_us> wallclock(uint32_t ssrc, uint32_t rtpTimestamp, util::timestamp_us arrival) const {
+        auto it = m_sources.find(ssrc);
+        if (it == m_sources.end() || it->second.reports.empty() || it->second.clockRate == 0)
+            return {};
+        const auto& reports = it->second.reports;
+        auto report = std::ranges::upper_bound(reports, arrival, {}, &SenderReport::arrival);
+        if (report != reports.begin())
+            --report;
+
+        const auto delta = static_cast<int32_t>(rtpTimestamp - report->rtpTimestamp);
+        return report->wallclock + delta * 1'000'000LL / static_cast<int64_t>(it->second.clockRate);
+    }
+
+    const std::vector<SenderReport>* reports(uint32_t ssrc) const {
+        auto it = m_sources.find(ssrc);
+        return it == m_sources.end() ? nullptr : &it->second.reports;
+    }
+
+    uint32_t clockRate(uint32_t ssrc) const {
+        auto it = m_sources.find(ssrc);
+        return it == m_sources.end() ? 0 : it->second.clockRate;
+    }
+
+    template<typename F>
+    void forEach(F&& f) const {
+        for (auto&& [ssrc, source] : m_sources) {
+            f(ssrc, source.clockRate, source.reports);
+        }
+    }
+
+private:
+    struct Source
+    {
+        uint32_t clockRate = 0;
+        std::vector<SenderReport> reports;
+    };
+
+    // RTP ticks per wallclock second between the first and the last report
+    static uint32_t estimateClockRate(const std::vector<SenderReport>& reports) {
+        if (reports.size() < 2)
+            return 0;
+        const auto& first = reports.front();
+        const auto& last = reports.back();
+        if (last.wallclock <= first.wallclock)
+            return 0;
+        const auto ticks = static_cast<double>(static_cast<uint32_t>(last.rtpTimestamp - first.rtpTimestamp));
+        return static_cast<uint32_t>(ticks * 1e6 / static_cast<double>(last.wallclock - first.wallclock) + 0.5);
+    }
+
+    std::unordered_map<uint32_t, Source> m_sources;
+};
+
+// Builds the clock index of a recorded stream: sender reports come from the RTCP channels,
+// clock rates from the SDP for the payload type each SSRC sends
+inline ClockIndex buildClockIndex(const PacketStore& store, std::string_view sdp) {
+    const auto clockRates = rtp::sdpClockRates(sdp);
+    ClockIndex index;
+    for (auto&& packet : store.packets()) {
+        auto data = store.data(packet);
+        if (PacketStore::isRtp(packet.channel)) {
+            // the payload type of an SSRC doesn't change, only the first packet is needed
+            if (auto header = rtp::parseHeader(data); header && index.clockRate(header->ssrc) == 0) {
+                if (auto rate = clockRates.find(header->payloadType); rate != clockRates.end())
+                    index.setClockRate(header->ssrc, rate->second);
+            }
+            continue;
+        }
+        forEachPacket(data, [&](const Packet& rtcpPacket) {
+            if (auto report = parseReport(rtcpPacket); report && report->isSender)
+                index.add(report->ssrc, *report, packet.arrival);
+        });
+    }
+    index.finalize();
+    return index;
+}
+
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace rtp {
+
+constexpr size_t HEADER_SIZE = 12;
+constexpr uint8_t VERSION = 2;
+
+// Big-endian loads at fixed offsets, compilers turn them into a single load + bswap
+inline uint16_t load16(const char* p) {
+    return static_cast<uint16_t>(static_cast<uint8_t>(p[0]) << 8 | static_cast<uint8_t>(p[1]));
+}
+
+inline uint32_t load32(const char* p) {
+    return static_cast<uint32_t>(load16(p)) << 16 | load16(p + 2);
+}
+
+// RTP fixed header (RFC 3550, 5.1). Variable parts are views into the packet.
+struct Header
+{
+    bool padding = false;
+    bool marker = false;
+    uint8_t payloadType = 0;
+    uint16_t sequenceNumber = 0;
+    uint32_t timestamp = 0;
+    uint32_t ssrc = 0;
+
+    // 4 bytes per contributing source
+    std::string_view csrc;
+    std::optional<uint16_t> extensionProfile;
+    // extension data without the profile and length words
+    std::string_view extension;
+    // payload without padding
+    std::string_view payload;
+
+    size_t csrcCount() const {
+        return csrc.size() / 4;
+    }
+
+    uint32_t csrcAt(size_t i) const {
+        return load32(csrc.data() + i * 4);
+    }
+};
+
+// Returns nothing if the packet is too short or isn't RTP version 2
+inline std::optional<Header> parseHeader(std::string_view packet) {
+    if (packet.size() < HEADER_SIZE)
+        return {};
+
+    const char* p = packet.data();
+    const auto b0 = static_cast<uint8_t>(p[0]);
+    const auto b1 = static_cast<uint8_t>(p[1]);
+    if (b0 >> 6 != VERSION)
+        return {};
+
+    Header header;
+    header.padding = b0 & 0x20;
+    const bool hasExtension = b0 & 0x10;
+    const size_t csrcCount = b0 & 0x0f;
+    header.marker = b1 & 0x80;
+    header.payloadType = b1 & 0x7f;
+    header.sequenceNumber = load16(p + 2);
+    header.timestamp = load32(p + 4);
+    header.ssrc = load32(p + 8);
+
+    size_t pos = HEADER_SIZE;
+    if (packet.size() < pos + csrcCount * 4)
+        return {};
+    header.csrc = packet.substr(pos, csrcCount * 4);
+    pos += csrcCount * 4;
+
+    if (hasExtension) {
+        if (packet.size() < pos + 4)
+            return {};
+        header.extensionProfile = load16(p + pos);
+        const size_t length = load16(p + pos + 2) * 4;
+        pos += 4;
+        if (packet.size() < pos + length)
+            return {};
+        header.extension = packet.substr(pos, length);
+        pos += length;
+    }
+
+    size_t end = packet.size();
+    if (header.padding) {
+        const size_t padding = static_cast<uint8_t>(packet.back());
+        if (padding == 0 || end - pos < padding)
+            return {};
+        end -= padding;
+    }
+    header.payload = packet.substr(pos, end - pos);
+    return header;
+}
+
+// Headers of many packets as struct-of-arrays, so per-field scans (sequence gaps, timestamps)
+// run over dense arrays. Packets that aren't valid RTP are skipped, `index` maps back to the input.
+struct HeaderBatch
+{
+    std::vector<uint32_t> index;
+    std::vector<uint16_t> sequenceNumber;
+    std::vector<uint32_t> timestamp;
+    std::vector<uint32_t> ssrc;
+    std::vector<uint8_t> payloadType;
+    std::vector<uint8_t> marker;
+    // offset of the payload in the packet
+    std::vector<uint16_t> payloadOffset;
+
+    size_t size() const {
+        return index.size();
+    }
+
+    void reserve(size_t size) {
+        index.reserve(size);
+        sequenceNumber.reserve(size);
+        timestamp.reserve(size);
+        ssrc.reserve(size);
+        payloadType.reserve(size);
+        marker.reserve(size);
+        payloadOffset.reserve(size);
+    }
+
+    void push_back(uint32_t i, std::string_view packet) {
+        auto header = parseHeader(packet);
+        if (!header)
+            return;
+        index.push_back(i);
+        sequenceNumber.push_back(header->sequenceNumber);
+        timestamp.push_back(header->timestamp);
+        ssrc.push_back(header->ssrc);
+        payloadType.push_back(header->payloadType);
+        marker.push_back(header->marker);
+        payloadOffset.push_back(static_cast<uint16_t>(header->payload.data() - packet.data()));
+    }
+};
+
+// Decodes the headers of all packets of a range of string_views
+template<typename Packets>
+HeaderBatch decodeHeaders(const Packets& packets) {
+    HeaderBatch batch;
+    batch.reserve(std::size(packets));
+    uint32_t i = 0;
+    for (std::string_view packet : packets) {
+        batch.push_back(i++, packet);
+    }
+    return batch;
+}
+
+}
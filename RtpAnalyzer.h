@@ -0,0 +1,254 @@
+#pragma once
+
+#include "Rtp.h"
+#include "Utility.h"
+
+#include <fmt/format.h>
+
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <unordered_map>
+
+namespace rtp {
+
+// Clock rates of the payload types of an SDP ("a=rtpmap:96 H264/90000")
+inline std::unordered_map<uint8_t, uint32_t> sdpClockRates(std::string_view sdp) {
+    std::unordered_map<uint8_t, uint32_t> rates;
+    constexpr std::string_view RTPMAP = "a=rtpmap:";
+    for (size_t pos = sdp.find(RTPMAP); pos != std::string_view::npos; pos = sdp.find(RTPMAP, pos)) {
+        pos += RTPMAP.size();
+        auto line = sdp.substr(pos, sdp.find_first_of("\r\n", pos) - pos);
+        auto slash = line.find('/');
+        if (slash == std::string_view::npos)
+            continue;
+        PatterSeekerNS::PatternSeeker pt(line);
+        PatterSeekerNS::PatternSeeker rate(line.substr(slash + 1));
+        rates[static_cast<uint8_t>(pt.takeUInt64(0))] = static_cast<uint32_t>(rate.takeUInt64(0));
+    }
+    return rates;
+}
+
+// Single-pass quality statistics of every SSRC of a capture: loss, reordering,
+// RFC 3550 interarrival jitter and per-second bitrate/frame rate.
+// The state of an SSRC is a few counters, so day-long captures are analyzed in constant memory.
+class Analyzer
+{
+public:
+    struct Summary
+    {
+        uint32_t ssrc = 0;
+        uint8_t payloadType = 0;
+        uint32_t clockRate = 0;
+        uint64_t packets = 0;
+        uint64_t bytes = 0;
+        // packets the sequence numbers account for, wraparound included
+        uint64_t expected = 0;
+        uint16_t maxSequence = 0;
+        uint32_t cycles = 0;
+        // arrived later than a packet with a higher sequence number
+        uint64_t reordered = 0;
+        uint64_t duplicates = 0;
+        // frames are counted by the changes of the RTP timestamp
+        uint64_t frames = 0;
+        // in timestamp units, see RFC 3550, A.8
+        double jitter = 0;
+        util::timestamp_us first = 0;
+        util::timestamp_us last = 0;
+
+        // negative when there are duplicates
+        int64_t lost() const {
+            return static_cast<int64_t>(expected) - static_cast<int64_t>(packets - duplicates);
+        }
+
+        double jitterMs() const {
+            return clockRate ? jitter * 1000.0 / clockRate : 0;
+        }
+
+        double durationS() const {
+            return (last - first) / 1e6;
+        }
+    };
+
+    // One second of one SSRC
+    struct Sample
+    {
+        uint32_t ssrc = 0;
+        // seconds since the first packet of the capture
+        uint64_t second = 0;
+        uint64_t packets = 0;
+        uint64_t bytes = 0;
+        uint64_t frames = 0;
+        // gaps in the sequence numbers seen during this second
+        uint64_t lost = 0;
+        double jitterMs = 0;
+    };
+
+    using sample_sink_t = std::function<void(const Sample&)>;
+
+    // Payload types that aren't in `clockRates` are assumed to be video (90 kHz)
+    explicit Analyzer(std::unordered_map<uint8_t, uint32_t> clockRates = {}, sample_sink_t sink = {}) :
+        m_clockRates(std::move(clockRates)),
+        m_sink(std::move(sink))
+    {}
+
+    void feed(std::string_view packet, util::timestamp_us arrival) {
+        if (auto header = parseHeader(packet))
+            feed(*header, packet.size(), arrival);
+    }
+
+    void feed(const Header& header, size_t size, util::timestamp_us arrival) {
+        if (m_origin == 0)
+            m_origin = arrival;
+
+        auto [it, isNew] = m_sources.try_emplace(header.ssrc);
+        auto& source = it->second;
+        auto& summary = source.summary;
+        if (isNew) {
+            summary.ssrc = header.ssrc;
+            summary.payloadType = header.payloadType;
+            summary.clockRate = clockRate(header.payloadType);
+            summary.maxSequence = header.sequenceNumber;
+            summary.expected = 1;
+            summary.first = arrival;
+            source.lastTimestamp = header.timestamp;
+            source.second = secondOf(arrival);
+            summary.frames = 1;
+            source.sample.frames = 1;
+        }
+        else {
+            flushUntil(source, secondOf(arrival));
+            sequence(source, header.sequenceNumber);
+            // a late packet of an earlier frame isn't a new frame
+            if (static_cast<int32_t>(header.timestamp - source.lastTimestamp) > 0) {
+                ++summary.frames;
+                ++source.sample.frames;
+                source.lastTimestamp = header.timestamp;
+            }
+        }
+
+        ++summary.packets;
+        summary.bytes += size;
+        summary.last = arrival;
+        ++source.sample.packets;
+        source.sample.bytes += size;
+        updateJitter(source, header.timestamp, arrival, isNew);
+    }
+
+    // Emits the last, incomplete second of every SSRC
+    void finish() {
+        for (auto&& [ssrc, source] : m_sources) {
+            emit(source);
+        }
+    }
+
+    template<typename F>
+    void forEach(F&& f) const {
+        for (auto&& [ssrc, source] : m_sources) {
+            f(source.summary);
+        }
+    }
+
+    friend std::ostream& operator<<(std::ostream& oss, const Summary& s) {
+        const auto duration = s.durationS();
+        oss << fmt::format("SSRC {:08x} PT {} ({} Hz): {} packets, lost {} ({:.2f}%), reordered {}, duplicates {}, jitter {:.2f} ms",
+            s.ssrc, s.payloadType, s.clockRate, s.packets, s.lost(), s.expected ? 100.0 * s.lost() / s.expected : 0.0,
+            s.reordered, s.duplicates, s.jitterMs());
+        if (duration > 0)
+            oss << fmt::format(", {:.1f} kbit/s, {:.2f} fps", s.bytes * 8 / duration / 1000, (s.frames - 1) / duration);
+        return oss;
+    }
+
+private:
+    // RFC 3550, A.1: a jump further than this is a restart of the sequence, not a loss
+    static constexpr uint32_t MAX_DROPOUT = 3000;
+    static constexpr uint32_t MAX_MISORDER = 100;
+
+    struct Source
+    {
+        Summary summary;
+        // timestamp of the last frame
+        uint32_t lastTimestamp = 0;
+        // of the last packet, for the jitter
+        uint32_t lastPacketTimestamp = 0;
+        util::timestamp_us lastArrival = 0;
+        uint64_t second = 0;
+        Sample sample;
+    };
+
+    uint32_t clockRate(uint8_t payloadType) const {
+        if (auto it = m_clockRates.find(payloadType); it != m_clockRates.end() && it->second)
+            return it->second;
+        // static audio payload types of RFC 3551 are 8 kHz
+        return payloadType < 20 && payloadType != 14 ? 8000 : 90000;
+    }
+
+    uint64_t secondOf(util::timestamp_us arrival) const {
+        return arrival > m_origin ? (arrival - m_origin) / 1'000'000 : 0;
+    }
+
+    void sequence(Source& source, uint16_t seq) {
+        auto& summary = source.summary;
+        const uint16_t delta = seq - summary.maxSequence;
+        if (delta == 0) {
+            ++summary.duplicates;
+        }
+        else if (delta < MAX_DROPOUT) {
+            // in order, maybe after a gap
+            if (seq < summary.maxSequence)
+                ++summary.cycles;
+            summary.maxSequence = seq;
+            summary.expected += delta;
+            source.sample.lost += delta - 1;
+        }
+        else if (delta <= 65536 - MAX_MISORDER) {
+            // the sender restarted the sequence
+            summary.maxSequence = seq;
+            summary.expected += 1;
+        }
+        else {
+            // late: it fills a gap that was counted as lost
+            ++summary.reordered;
+            if (source.sample.lost > 0)
+                --source.sample.lost;
+        }
+    }
+
+    // D(i-1, i) of RFC 3550, 6.4.1, the RTP timestamp difference is signed so wraparound doesn't matter
+    void updateJitter(Source& source, uint32_t timestamp, util::timestamp_us arrival, bool isFirst) {
+        auto& summary = source.summary;
+        if (!isFirst) {
+            const double arrivalDelta = (static_cast<double>(arrival) - static_cast<double>(source.lastArrival)) * summary.clockRate / 1e6;
+            const auto timestampDelta = static_cast<int32_t>(timestamp - source.lastPacketTimestamp);
+            const double d = std::fabs(arrivalDelta - timestampDelta);
+            summary.jitter += (d - summary.jitter) / 16;
+        }
+        source.lastArrival = arrival;
+        source.lastPacketTimestamp = timestamp;
+    }
+
+    void flushUntil(Source& source, uint64_t second) {
+        if (second == source.second)
+            return;
+        emit(source);
+        source.sample = {};
+        source.second = second;
+    }
+
+    void emit(Source& source) {
+        if (!m_sink || source.sample.packets == 0)
+            return;
+        source.sample.ssrc = source.summary.ssrc;
+        source.sample.second = source.second;
+        source.sample.jitterMs = source.summary.jitterMs();
+        m_sink(source.sample);
+    }
+
+    std::unordered_map<uint8_t, uint32_t> m_clockRates;
+    sample_sink_t m_sink;
+    std::unordered_map<uint32_t, Source> m_sources;
+    util::timestamp_us m_origin = 0;
+};
+
+}
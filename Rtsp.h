@@ -2,16 +2,21 @@
 
 #include "Utility.h"
 #include "PatternSeeker.h"
+#include "PacketStore.h"
+#include "PacketDump.h"
+#include "ContentStore.h"
 
+#include <algorithm>
+#include <array>
 #include <fstream>
 #include <filesystem>
+#include <optional>
+#include <utility>
 
 namespace fs = std::filesystem;
 
 using headers_t = std::unordered_map<std::string, std::string>;
 
-static const std::string_view DELIM = "<--__-->";
-
 // TODO: come up with better name
 std::string replaceSymbols(std::string str) {
 	for (auto& ch : str) {
@@ -21,20 +26,68 @@ std::string replaceSymbols(std::string str) {
 	return str;
 }
 
+// Location of a header value inside a pre-serialized response
+struct ValueSpan
+{
+	size_t offset = 0;
+	size_t length = 0;
+
+	bool isEmpty() const {
+		return length == 0;
+	}
+};
+
 struct RtspStep
 {
 	std::string method;
 	std::string m_url;
 	headers_t headers;
-	std::string response;
+	// equal responses of all streams share one copy once the catalog is finalized
+	std::shared_ptr<const std::string> m_response = std::make_shared<const std::string>();
+
+	// Filled by prepare(): the recorded CSeq and where the per-session values are in `response`
+	uint32_t cseq = 0;
+	ValueSpan cseqValue;
+	ValueSpan sessionIdValue;
+
+	// Locates CSeq and the session id (without ";timeout=") in the recorded response,
+	// so a session can substitute its own values without parsing the response again.
+	void prepare() {
+		auto spanOf = [this](std::string_view value) {
+			return value.empty() ? ValueSpan{} : ValueSpan{ static_cast<size_t>(value.data() - response().data()), value.size() };
+		};
+
+		auto cseqStr = util::findHeaderValue(response(), "CSeq");
+		cseq = static_cast<uint32_t>(PatternSeeker(cseqStr).takeUInt64(0));
+		cseqValue = spanOf(cseqStr);
+
+		auto session = util::findHeaderValue(response(), "Session");
+		sessionIdValue = spanOf(session.substr(0, session.find(';')));
+	}
+
+	std::string_view response() const {
+		return *m_response;
+	}
+
+	// Takes the response from `store`, so equal ones keep one copy. The spans stay valid, the bytes are the same
+	void share(ContentStore& store) {
+		m_response = store.intern(*m_response).bytes;
+	}
+
+	// Path part of the recorded request url, e.g. "/cam1/trackID=1"
+	std::string_view path() const {
+		std::string_view url = m_url;
+		auto slash = url.find('/');
+		return slash == std::string_view::npos ? std::string_view{} : url.substr(slash);
+	}
 
 	friend std::ostream& operator<<(std::ostream& oss, RtspStep& step) {
 		oss << step.method << ' ' << step.m_url;
 		for (auto&& [header, val] : step.headers) {
 			oss << '\n' << header << ": " << val;
 		}
-		if (!step.response.empty())
-			oss << "\n" << step.response << '\n';
+		if (!step.response().empty())
+			oss << "\n" << step.response() << '\n';
 		return oss;
 	}
 };
@@ -43,11 +96,74 @@ struct RtspStream
 {
 	std::vector<RtspStep> m_steps;
 	std::string m_uri;
-	std::vector<std::string> m_payload;
-	uint32_t step = 0;
+	// interleaved RTP/RTCP packets sent by the camera, in arrival order once the catalog is finalized
+	PacketStore m_packets;
+	// packets where a keyframe access unit starts, ascending; built when the catalog is finalized
+	std::vector<uint32_t> m_keyframes;
+
+	// Packet to start playing from to show `offset` (from the first packet) as soon as possible:
+	// the last keyframe at or before it, or the first keyframe if there's none yet. O(log n)
+	size_t seek(util::timestamp_us offset) const {
+		const auto& packets = m_packets.packets();
+		if (m_keyframes.empty() || packets.empty())
+			return 0;
 
-	const RtspStep& getNextStep() {
-		return m_steps[step++ % m_steps.size()];
+		const auto target = packets.front().arrival + offset;
+		auto it = std::upper_bound(m_keyframes.begin(), m_keyframes.end(), target, [&packets](util::timestamp_us value, uint32_t packet) {
+			return value < packets[packet].arrival;
+		});
+		return it == m_keyframes.begin() ? *it : *std::prev(it);
+	}
+
+	// Session description from the DESCRIBE response, empty if it wasn't recorded
+	std::string_view sdp() const {
+		for (auto&& step : m_steps) {
+			if (step.method != "DESCRIBE")
+				continue;
+			auto response = step.response();
+			auto body = response.find("\r\n\r\n");
+			return body == std::string_view::npos ? std::string_view{} : response.substr(body + 4);
+		}
+		return {};
+	}
+};
+
+// RTP or RTCP of a track that a SETUP response sent over UDP ("Transport: RTP/AVP;unicast;client_port=5000-5001;server_port=6970-6971").
+// Its datagrams are stored like interleaved frames, on channel 2 * track (RTP) and 2 * track + 1 (RTCP).
+struct UdpTrack
+{
+	uint16_t clientPort = 0;
+	uint16_t serverPort = 0;
+	uint8_t channel = 0;
+
+	// RTP on `rtpChannel` and RTCP on the next one, RTCP ports are the second ones of the ranges
+	// (the next ports if a range has one port, RFC 3550, 11).
+	// Returns nothing for interleaved (TCP) transports and transports without both port ranges
+	static std::optional<std::array<UdpTrack, 2>> fromTransport(std::string_view transport, uint8_t rtpChannel) {
+		if (transport.find("interleaved=") != std::string_view::npos)
+			return {};
+		auto client = portsOf(transport, "client_port=");
+		auto server = portsOf(transport, "server_port=");
+		if (!client || !server)
+			return {};
+		return std::array<UdpTrack, 2>{ UdpTrack{ client->first, server->first, rtpChannel },
+			UdpTrack{ client->second, server->second, static_cast<uint8_t>(rtpChannel + 1) } };
+	}
+
+private:
+	// "<first>[-<second>]"
+	static std::optional<std::pair<uint16_t, uint16_t>> portsOf(std::string_view transport, std::string_view name) {
+		auto pos = transport.find(name);
+		if (pos == std::string_view::npos)
+			return {};
+		auto value = transport.substr(pos + name.size());
+		value = value.substr(0, value.find(';'));
+		auto dash = value.find('-');
+		auto first = PatternSeeker(value.substr(0, dash)).takeUInt64(0);
+		auto second = dash == std::string_view::npos ? first + 1 : PatternSeeker(value.substr(dash + 1)).takeUInt64(0);
+		if (first == 0 || first > 0xffff || second == 0 || second > 0xffff)
+			return {};
+		return std::pair{ static_cast<uint16_t>(first), static_cast<uint16_t>(second) };
 	}
 };
 
@@ -56,22 +172,52 @@ struct PrepareRtspStream
 private:
 	std::vector<RtspStep> m_steps;
 	std::string m_uri;
-	//std::ofstream m_file;
-	//std::ofstream m_testfileOut;
-	//std::ofstream m_testfileIn;
-	std::vector<std::string> m_payload;
+	PacketStore m_packets;
+	// packets are also written to "<directory>/<uri>.dump" if a directory is set
+	fs::path m_dumpDirectory;
+	std::optional<dump::Writer> m_dump;
+	InterleavedDeframer m_deframer;
+	// RTP and RTCP of every track set up over UDP
+	std::vector<UdpTrack> m_udpTracks;
+	uint8_t m_tracks = 0;
 
 public:
-	void parseRstp(std::string data, bool isRequest) {
+	void parseRstp(std::string data, bool isRequest, util::timestamp_us arrival) {
 		if (isRequest) {
 			parseRequest(data);
 			return;
 		}
-		parseResponse(data);
+		parseResponse(data, arrival);
+	}
+
+	// Writes every packet of the stream to a dump in `directory` as it's parsed, see PacketDump.h
+	void dumpTo(fs::path directory) {
+		m_dumpDirectory = std::move(directory);
+	}
+
+	// Moves the collected stream out, the object is empty afterwards
+	RtspStream takeStream() {
+		RtspStream stream{ std::move(m_steps), std::move(m_uri), std::move(m_packets) };
+		for (auto& step : stream.m_steps) {
+			step.prepare();
+		}
+		stream.m_packets.shrinkToFit();
+		return stream;
+	}
+
+	const std::string& uri() const {
+		return m_uri;
 	}
 
-	RtspStream getStream() const {
-		return RtspStream{ m_steps, m_uri, m_payload };
+	// Filled as SETUP responses are parsed, so datagrams that follow can be attributed to the stream
+	const std::vector<UdpTrack>& udpTracks() const {
+		return m_udpTracks;
+	}
+
+	// A datagram of one of udpTracks()
+	void addDatagram(uint8_t channel, std::string_view data, util::timestamp_us arrival) {
+		m_packets.append(channel, data, arrival);
+		dumpFrom(m_packets.size() - 1);
 	}
 
 	friend std::ostream& operator<<(std::ostream& oss, RtspStream& stream) {
@@ -87,7 +233,7 @@ private:
 		RtspStep step;
 		PatternSeeker parser{ data };
 
-		static std::string_view methods[] = { "OPTIONS", "DESCRIBE", "SETUP", "PLAY", "TEARDOWN", "PAUSE" };
+		static std::string_view methods[] = { "OPTIONS", "DESCRIBE", "SETUP", "PLAY", "TEARDOWN", "PAUSE", "GET_PARAMETER", "SET_PARAMETER" };
 
 		for (auto&& method : methods) {
 			if (parser.startsWith(method)) {
@@ -119,29 +265,42 @@ private:
 		m_steps.push_back(step);
 	}
 
-	void parseResponse(std::string data) {
-		PatternSeeker parser{ data };
-		if (parser.expect("RTSP/1.0")) {
-			if (m_steps.empty()) {
-				std::cout << "WARNING!!! We got response without request";
-				return;
-			}
-			m_steps.back().response = data;
+	void dumpFrom(size_t first) {
+		if (m_dumpDirectory.empty() || first == m_packets.size())
 			return;
+		if (!m_dump) {
+			m_dump.emplace(m_dumpDirectory / (replaceSymbols(m_uri) + ".dump"));
+			if (!m_dump->isOpen())
+				std::cout << "Can't create a dump for " << m_uri << '\n';
+		}
+		for (size_t i = first; i < m_packets.size(); ++i) {
+			const auto& packet = m_packets.packets()[i];
+			m_dump->write(packet.channel, m_packets.data(packet), packet.arrival);
 		}
+	}
 
-		m_payload.push_back(data);
+	void setupTrack(std::string_view response) {
+		const uint8_t rtp = static_cast<uint8_t>(m_tracks++ * 2);
+		auto tracks = UdpTrack::fromTransport(util::findHeaderValue(response, "Transport"), rtp);
+		if (!tracks)
+			return;
+		m_udpTracks.insert(m_udpTracks.end(), tracks->begin(), tracks->end());
+	}
 
-		/*if (!m_file.is_open()) {
-			m_file.open(replaceSymbols(m_uri) + ".txt", std::ios::out | std::ios::binary);
-		}
+	void parseResponse(std::string data, util::timestamp_us arrival) {
+		// responses may come between the interleaved frames and share a TCP segment with them
+		const size_t first = m_packets.size();
+		m_deframer.feed(data, arrival, m_packets, [this](std::string_view response) { addResponse(response); });
+		dumpFrom(first);
+	}
 
-		if (!m_testfileOut.is_open()) {
-			m_testfileOut.open(replaceSymbols(m_uri) + "out.txt", std::ios::out | std::ios::binary);
+	void addResponse(std::string_view response) {
+		if (m_steps.empty()) {
+			std::cout << "WARNING!!! We got response without request";
+			return;
 		}
-		if (m_file.is_open()) {
-			m_file << data << DELIM << '`';
-			m_testfileOut << data;
-		}*/
+		m_steps.back().m_response = std::make_shared<const std::string>(response);
+		if (m_steps.back().method == "SETUP")
+			setupTrack(response);
 	}
 };
\ No newline at end of file
@@ -0,0 +1,467 @@
+#pragma once
+
+#include "Rtp.h"
+#include "Rtsp.h"
+#include "Utility.h"
+
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <functional>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+// Replay state of one RTSP client connection.
+// The recorded stream is shared and read-only, everything that changes while replaying lives here,
+// so any number of clients (on any number of threads) can play the same recording.
+class RtspSession
+{
+public:
+    // CSeq value + session id + the recorded bytes around them
+    using response_buffers_t = std::array<boost::asio::const_buffer, 5>;
+
+    // `camera` - number of the virtual camera the recording is played as, its RTP headers are rewritten on send
+    explicit RtspSession(const RtspStream& stream, std::optional<uint32_t> camera = {}) :
+        m_stream(&stream),
+        m_sessionId(generateSessionId()),
+        m_camera(camera)
+    {}
+
+    const RtspStream& stream() const {
+        return *m_stream;
+    }
+
+    std::optional<uint32_t> camera() const {
+        return m_camera;
+    }
+
+    // Writes the 12-byte fixed RTP header of `packet` to `out` as the virtual camera sends it:
+    // SSRC, sequence number and timestamp are shifted by values derived from the camera number and the track,
+    // so every camera has its own and a reconnect to the same camera gets the same ones.
+    // Returns false if the packet isn't RTP.
+    bool rewriteRtpHeader(uint8_t channel, std::string_view packet, char* out) const {
+        if (!m_camera || packet.size() < rtp::HEADER_SIZE || static_cast<uint8_t>(packet[0]) >> 6 != rtp::VERSION)
+            return false;
+
+        const auto identity = identityOf(channel);
+        const char* p = packet.data();
+        out[0] = p[0];
+        out[1] = p[1];
+        util::storeBigEndian(out + 2, identity.sequence(rtp::load16(p + 2)));
+        util::storeBigEndian(out + 4, identity.timestamp(rtp::load32(p + 4)));
+        util::storeBigEndian(out + 8, identity.ssrc(rtp::load32(p + 8)));
+        return true;
+    }
+
+    // Finds the recorded step that answers `method` with client's `cseq`.
+    // Once the first request is matched, the offset between client's and recorded CSeq is known
+    // and is used to pick the right step among several with the same method (e.g. SETUP per track).
+    // Falls back to the next step with the same method after the last matched one,
+    // preferring the one for the same track (the last segment of the path, e.g. "trackID=1").
+    // Returns nullptr if the recording has no such method.
+    const RtspStep* match(std::string_view method, std::string_view path, uint32_t cseq) {
+        const auto& steps = m_stream->m_steps;
+        if (steps.empty())
+            return nullptr;
+
+        if (m_cseqDelta) {
+            const uint32_t recorded = cseq - *m_cseqDelta;
+            for (size_t i = 0; i < steps.size(); ++i) {
+                if (steps[i].method == method && steps[i].cseq == recorded)
+                    return accept(i, cseq);
+            }
+        }
+
+        const RtspStep* sameMethod = nullptr;
+        size_t sameMethodIdx = 0;
+        for (size_t n = 0; n < steps.size(); ++n) {
+            const size_t i = (m_next + n) % steps.size();
+            if (steps[i].method != method)
+                continue;
+            if (lastSegment(steps[i].path()) == lastSegment(path))
+                return accept(i, cseq);
+            if (!sameMethod) {
+                sameMethod = &steps[i];
+                sameMethodIdx = i;
+            }
+        }
+
+        return sameMethod ? accept(sameMethodIdx, cseq) : nullptr;
+    }
+
+    // Buffers of the recorded response of `step` with CSeq and the session id replaced.
+    // A PLAY response gets the Range and RTP-Info of the packet play() put the cursor at, so it's called after play().
+    // A SETUP response announces the interleaved channels the track is sent on, also for a track recorded over UDP.
+    // A virtual camera also gets its own SSRC in the SETUP Transport and its seq/rtptime in the PLAY RTP-Info,
+    // so its signalling matches its packets. SETUP and PLAY responses are rendered into the session.
+    // They point into the step and into this session, so both must outlive the write.
+    response_buffers_t response(const RtspStep& step, uint32_t cseq) {
+        auto buffers = recordedResponse(step, cseq);
+        const bool isPlay = step.method == "PLAY";
+        if (!isPlay && step.method != "SETUP")
+            return buffers;
+
+        m_rendered.clear();
+        for (auto&& buffer : buffers) {
+            m_rendered.append(static_cast<const char*>(buffer.data()), buffer.size());
+        }
+        if (isPlay) {
+            rewriteRange();
+            rewriteRtpInfo();
+        }
+        else {
+            rewriteTransport(step);
+        }
+        return { boost::asio::buffer(m_rendered) };
+    }
+
+    std::string_view sessionId() const {
+        return m_sessionId;
+    }
+
+    // Packet PLAY starts from: the keyframe before `npt` if a Range was requested,
+    // otherwise where the last PAUSE left off, or the first keyframe on the first PLAY
+    size_t play(std::optional<util::timestamp_us> npt) {
+        if (npt || !m_cursor)
+            m_cursor = m_stream->seek(npt.value_or(0));
+        return *m_cursor;
+    }
+
+    // The next packet to send, kept across PAUSE
+    void advance(size_t cursor) {
+        m_cursor = cursor;
+    }
+
+private:
+    // How a virtual camera shifts the RTP identity of a track
+    struct Identity
+    {
+        uint64_t mix;
+
+        uint16_t sequence(uint16_t recorded) const {
+            return static_cast<uint16_t>(recorded + static_cast<uint16_t>(mix));
+        }
+
+        uint32_t timestamp(uint32_t recorded) const {
+            return recorded + static_cast<uint32_t>(mix >> 16);
+        }
+
+        uint32_t ssrc(uint32_t recorded) const {
+            return recorded ^ static_cast<uint32_t>(mix >> 32);
+        }
+    };
+
+    // splitmix64 of camera and track; the recorded one (nothing is shifted) if it's not a virtual camera
+    Identity identityOf(uint8_t channel) const {
+        if (!m_camera)
+            return { 0 };
+        uint64_t mix = (static_cast<uint64_t>(*m_camera) << 8 | channel / 2) + 0x9E3779B97F4A7C15ULL;
+        mix = (mix ^ (mix >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        mix = (mix ^ (mix >> 27)) * 0x94D049BB133111EBULL;
+        return { mix ^ (mix >> 31) };
+    }
+
+    // Channel the packets of the track set up by the recorded SETUP of `path` are stored on:
+    // the interleaved one, or 2 * track for UDP (see UdpTrack)
+    std::optional<uint8_t> channelOf(std::string_view path) const {
+        uint8_t track = 0;
+        for (auto&& step : m_stream->m_steps) {
+            if (step.method != "SETUP")
+                continue;
+            if (lastSegment(step.path()) == lastSegment(path)) {
+                auto transport = util::findHeaderValue(step.response(), "Transport");
+                auto interleaved = transport.find("interleaved=");
+                if (interleaved == std::string_view::npos)
+                    return static_cast<uint8_t>(track * 2);
+                return static_cast<uint8_t>(PatternSeeker(transport.substr(interleaved + 12)).takeUInt64(0));
+            }
+            ++track;
+        }
+        return {};
+    }
+
+    // Value of `name=` in a ';'-separated header part, as a span of m_rendered
+    std::optional<ValueSpan> parameterOf(std::string_view part, std::string_view name) const {
+        for (size_t pos = 0; pos < part.size();) {
+            auto end = std::min(part.find(';', pos), part.size());
+            auto parameter = util::trim(part.substr(pos, end - pos));
+            if (parameter.starts_with(name) && parameter.size() > name.size() && parameter[name.size()] == '=') {
+                auto value = parameter.substr(name.size() + 1);
+                return ValueSpan{ static_cast<size_t>(value.data() - m_rendered.data()), value.size() };
+            }
+            pos = end + 1;
+        }
+        return {};
+    }
+
+    // "Transport: RTP/AVP/TCP;unicast;interleaved=0-1;ssrc=1A2B3C4D".
+    // Media is always sent interleaved on the RTSP connection, so a track recorded over UDP
+    // ("RTP/AVP;unicast;client_port=...;server_port=...") is announced on the channels it's stored on.
+    void rewriteTransport(const RtspStep& step) {
+        auto channel = channelOf(step.path());
+        if (!channel)
+            return;
+        auto transport = util::findHeaderValue(m_rendered, "Transport");
+        if (!transport.empty() && transport.find("interleaved=") == std::string_view::npos) {
+            auto value = fmt::format("RTP/AVP/TCP;unicast;interleaved={}-{}", *channel, *channel + 1);
+            if (auto ssrc = parameterOf(transport, "ssrc"))
+                value.append(";ssrc=").append(m_rendered, ssrc->offset, ssrc->length);
+            m_rendered.replace(static_cast<size_t>(transport.data() - m_rendered.data()), transport.size(), value);
+            transport = util::findHeaderValue(m_rendered, "Transport");
+        }
+
+        auto span = parameterOf(transport, "ssrc");
+        if (!m_camera || !span)
+            return;
+        uint32_t recorded = 0;
+        auto value = std::string_view{ m_rendered }.substr(span->offset, span->length);
+        std::from_chars(value.data(), value.data() + value.size(), recorded, 16);
+        m_rendered.replace(span->offset, span->length, fmt::format("{:08X}", identityOf(*channel).ssrc(recorded)));
+    }
+
+    // Sequence number and timestamp of the first RTP packet on `channel` from the cursor on
+    std::optional<std::pair<uint16_t, uint32_t>> firstRtpHeader(uint8_t channel) const {
+        const auto& store = m_stream->m_packets;
+        const auto& packets = store.packets();
+        for (size_t i = m_cursor.value_or(0); i < packets.size(); ++i) {
+            if (packets[i].channel != channel)
+                continue;
+            auto data = store.data(packets[i]);
+            if (data.size() >= rtp::HEADER_SIZE && static_cast<uint8_t>(data[0]) >> 6 == rtp::VERSION)
+                return std::pair{ rtp::load16(data.data() + 2), rtp::load32(data.data() + 4) };
+        }
+        return {};
+    }
+
+    // "Range: npt=0.000-": the start is the time of the packet at the cursor, from the first packet
+    void rewriteRange() {
+        constexpr std::string_view NPT = "npt=";
+        auto range = util::findHeaderValue(m_rendered, "Range");
+        const auto& packets = m_stream->m_packets.packets();
+        const auto cursor = m_cursor.value_or(0);
+        if (!range.starts_with(NPT) || cursor >= packets.size())
+            return;
+        auto start = range.substr(NPT.size(), range.find('-') - NPT.size());
+        const auto offset = packets[cursor].arrival - packets.front().arrival;
+        m_rendered.replace(static_cast<size_t>(start.data() - m_rendered.data()), start.size(), fmt::format("{:.3f}", offset / 1e6));
+    }
+
+    // "RTP-Info: url=rtsp://host/cam/trackID=0;seq=1;rtptime=2,url=...": seq and rtptime of the first packet
+    // of every track that is sent from the cursor, shifted by the identity of a virtual camera.
+    // Tracks without packets there keep the recorded values. Replaced from the end, so the spans found before stay valid.
+    void rewriteRtpInfo() {
+        auto rtpInfo = util::findHeaderValue(m_rendered, "RTP-Info");
+        struct Replacement { ValueSpan span; std::string value; };
+        std::vector<Replacement> replacements;
+        for (size_t pos = 0; pos < rtpInfo.size();) {
+            const auto end = std::min(rtpInfo.find(',', pos), rtpInfo.size());
+            auto inResponse = rtpInfo.substr(pos, end - pos);
+            pos = end + 1;
+            auto url = parameterOf(inResponse, "url");
+            if (!url)
+                continue;
+            auto channel = channelOf(std::string_view{ m_rendered }.substr(url->offset, url->length));
+            if (!channel)
+                continue;
+            auto first = firstRtpHeader(*channel);
+            if (!first)
+                continue;
+            const auto identity = identityOf(*channel);
+            if (auto seq = parameterOf(inResponse, "seq"))
+                replacements.push_back({ *seq, std::to_string(identity.sequence(first->first)) });
+            if (auto rtptime = parameterOf(inResponse, "rtptime"))
+                replacements.push_back({ *rtptime, std::to_string(identity.timestamp(first->second)) });
+        }
+        std::ranges::sort(replacements, std::greater{}, [](const Replacement& replacement) { return replacement.span.offset; });
+        for (auto&& [span, value] : replacements) {
+            m_rendered.replace(span.offset, span.length, value);
+        }
+    }
+
+    response_buffers_t recordedResponse(const RtspStep& step, uint32_t cseq) {
+        auto [end, ec] = std::to_chars(m_cseq.data(), m_cseq.data() + m_cseq.size(), cseq);
+        UNUSED(ec);
+        std::string_view cseqStr{ m_cseq.data(), static_cast<size_t>(end - m_cseq.data()) };
+
+        struct Replacement { ValueSpan span; std::string_view value; };
+        std::array<Replacement, 2> replacements{ {
+            { step.cseqValue, step.cseqValue.isEmpty() ? std::string_view{} : cseqStr },
+            { step.sessionIdValue, step.sessionIdValue.isEmpty() ? std::string_view{} : std::string_view{ m_sessionId } },
+        } };
+        if (replacements[0].span.offset > replacements[1].span.offset)
+            std::swap(replacements[0], replacements[1]);
+
+        response_buffers_t buffers;
+        std::string_view recorded = step.response();
+        size_t pos = 0;
+        size_t i = 0;
+        for (auto&& [span, value] : replacements) {
+            if (span.isEmpty())
+                continue;
+            buffers[i++] = boost::asio::buffer(recorded.substr(pos, span.offset - pos));
+            buffers[i++] = boost::asio::buffer(value);
+            pos = span.offset + span.length;
+        }
+        buffers[i++] = boost::asio::buffer(recorded.substr(pos));
+        for (; i < buffers.size(); ++i) {
+            buffers[i] = boost::asio::const_buffer{};
+        }
+        return buffers;
+    }
+
+    const RtspStep* accept(size_t idx, uint32_t cseq) {
+        const auto& step = m_stream->m_steps[idx];
+        m_cseqDelta = cseq - step.cseq;
+        m_next = idx + 1;
+        return &step;
+    }
+
+    static std::string_view lastSegment(std::string_view path) {
+        auto slash = path.find_last_of('/');
+        return slash == std::string_view::npos ? path : path.substr(slash + 1);
+    }
+
+    static std::string generateSessionId() {
+        static std::atomic<uint64_t> counter{ std::random_device{}() };
+        const uint64_t id = counter.fetch_add(1, std::memory_order_relaxed) * 0x9E3779B97F4A7C15ULL;
+        std::array<char, 16> buf;
+        auto [end, ec] = std::to_chars(buf.data(), buf.data() + buf.size(), id >> 16, 16);
+        UNUSED(ec);
+        return std::string{ buf.data(), end };
+    }
+
+    const RtspStream* m_stream;
+    std::string m_sessionId;
+    size_t m_next = 0;
+    std::optional<uint32_t> m_cseqDelta;
+    std::array<char, 10> m_cseq;
+    std::optional<size_t> m_cursor;
+    std::optional<uint32_t> m_camera;
+    // SETUP/PLAY response until it's written
+    std::string m_rendered;
+};
+
+// Start of a "Range: npt=<start>-[<end>]" header value (RFC 2326, 3.6), seconds or h:m:s with a fraction.
+// Returns nothing if there's no start time ("npt=now-", no header, other formats).
+inline std::optional<util::timestamp_us> parseNptStart(std::string_view range) {
+    constexpr std::string_view NPT = "npt=";
+    range = util::trim(range);
+    if (range.substr(0, NPT.size()) != NPT)
+        return {};
+    range.remove_prefix(NPT.size());
+    range = range.substr(0, range.find('-'));
+    if (range.empty() || range == "now")
+        return {};
+
+    double seconds = 0;
+    while (!range.empty()) {
+        auto colon = range.find(':');
+        double part = 0;
+        auto token = range.substr(0, colon);
+        auto [end, ec] = std::from_chars(token.data(), token.data() + token.size(), part);
+        if (ec != std::errc{} || end != token.data() + token.size() || part < 0)
+            return {};
+        seconds = seconds * 60 + part;
+        range = colon == std::string_view::npos ? std::string_view{} : range.substr(colon + 1);
+    }
+    return static_cast<util::timestamp_us>(seconds * 1'000'000);
+}
+
+// Splits the byte stream of an RTSP connection into complete requests.
+// Data is read straight into one growable buffer that is reused for the whole connection.
+// A request is complete after "\r\n\r\n" plus Content-Length bytes of body (SET_PARAMETER, ANNOUNCE),
+// interleaved '$' frames the client sends on the same connection (RTCP receiver reports) are skipped.
+class RtspRequestFramer
+{
+public:
+    static constexpr size_t READ_SIZE = 4 * 1024;
+    static constexpr size_t MAX_REQUEST_SIZE = 64 * 1024;
+    // '$', channel, 16-bit length and the largest payload; next() waits for the whole frame
+    static constexpr size_t MAX_FRAME_SIZE = 4 + 0xFFFF;
+
+    RtspRequestFramer() :
+        m_buffer(std::max(MAX_REQUEST_SIZE, MAX_FRAME_SIZE) + READ_SIZE)
+    {}
+
+    // Space for the next read, nothing if the buffer is full (the connection should be closed then).
+    // Invalidates views returned by next()
+    std::optional<boost::beast::flat_buffer::mutable_buffers_type> prepare() {
+        if (m_buffer.size() + READ_SIZE > m_buffer.max_size()) {
+            m_overflow = true;
+            return {};
+        }
+        return m_buffer.prepare(READ_SIZE);
+    }
+
+    void commit(size_t size) {
+        m_buffer.commit(size);
+    }
+
+    // Returns the next complete request or nothing if more data is needed.
+    // The view stays valid until the next prepare().
+    std::optional<std::string_view> next() {
+        for (;;) {
+            std::string_view data{ static_cast<const char*>(m_buffer.data().data()), m_buffer.size() };
+            if (data.empty())
+                return {};
+
+            if (data.front() == '$') {
+                // '$', channel, 16-bit length
+                if (data.size() < 4)
+                    return {};
+                const size_t frameSize = 4 + (static_cast<uint8_t>(data[2]) << 8 | static_cast<uint8_t>(data[3]));
+                if (data.size() < frameSize)
+                    return {};
+                m_buffer.consume(frameSize);
+                continue;
+            }
+
+            if (m_headerSize == 0) {
+                // don't search the bytes we've already searched, but "\r\n\r\n" may start in them
+                auto end = data.find("\r\n\r\n", m_scanned > 3 ? m_scanned - 3 : 0);
+                if (end == std::string_view::npos) {
+                    m_scanned = data.size();
+                    m_overflow = data.size() > MAX_REQUEST_SIZE;
+                    return {};
+                }
+                m_headerSize = end + 4;
+                m_bodySize = PatternSeeker(util::findHeaderValue(data.substr(0, m_headerSize), "Content-Length")).takeUInt64(0);
+                if (m_headerSize + m_bodySize > MAX_REQUEST_SIZE) {
+                    m_overflow = true;
+                    return {};
+                }
+            }
+
+            const size_t size = m_headerSize + m_bodySize;
+            if (data.size() < size)
+                return {};
+
+            // consume() doesn't move the data, so the view is valid until prepare()
+            m_buffer.consume(size);
+            m_headerSize = 0;
+            m_bodySize = 0;
+            m_scanned = 0;
+            return data.substr(0, size);
+        }
+    }
+
+    // A request is larger than MAX_REQUEST_SIZE or the buffer is full, the connection should be closed
+    bool isOverflowed() const {
+        return m_overflow;
+    }
+
+private:
+    boost::beast::flat_buffer m_buffer;
+    size_t m_scanned = 0;
+    size_t m_headerSize = 0;
+    size_t m_bodySize = 0;
+    bool m_overflow = false;
+};
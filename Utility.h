@@ -9,7 +9,14 @@
 #include <iostream>
 #include <unordered_map>
 #include <span>
+#include <vector>
 #include <cassert>
+#include <chrono>
+#include <bit>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <type_traits>
 
 #include <boost/endian/arithmetic.hpp>
 
@@ -27,6 +34,25 @@ timestamp_ms convertToTimestamp(const timeval& timeValue)
     return timeValue.tv_sec * 1000ULL + timeValue.tv_usec / 1000ULL;
 }
 
+// Capture time in microseconds, precise enough for RTP jitter
+using timestamp_us = uint64_t;
+
+timestamp_us convertToTimestampUs(const timeval& timeValue)
+{
+    return timeValue.tv_sec * 1000000ULL + timeValue.tv_usec;
+}
+
+timestamp_us convertToTimestampUs(const timespec& timeValue)
+{
+    return timeValue.tv_sec * 1000000ULL + timeValue.tv_nsec / 1000ULL;
+}
+
+template<typename Clock, typename Duration>
+timestamp_us convertToTimestampUs(const std::chrono::time_point<Clock, Duration>& timePoint)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(timePoint.time_since_epoch()).count();
+}
+
 std::string_view trim(std::string_view in)
 {
     auto left = in.begin();
@@ -67,6 +93,18 @@ std::string trim(std::string in)
 
 
 
+std::vector<std::string> split(std::string_view str, char delim) {
+    std::vector<std::string> parts;
+    while (!str.empty()) {
+        auto pos = str.find(delim);
+        auto part = trim(str.substr(0, pos));
+        if (!part.empty())
+            parts.emplace_back(part);
+        str = pos == std::string_view::npos ? std::string_view{} : str.substr(pos + 1);
+    }
+    return parts;
+}
+
 bool isHttpPort(const pcpp::ConnectionData& connData) {
     return connData.dstPort == 80;
 }
@@ -125,97 +163,272 @@ headers_view_t parseHeaders(PatterSeekerNS::PatternSeeker parser) {
     return headers;
 }
 
+// Fast non-cryptographic 64-bit hash, reads the data 8 bytes at a time.
+// Used to index recorded requests/payloads, it's not stable across versions and mustn't be persisted.
+uint64_t hash64(std::string_view data, uint64_t seed = 0) {
+    constexpr uint64_t K0 = 0x9E3779B97F4A7C15ULL;
+    constexpr uint64_t K1 = 0xBF58476D1CE4E5B9ULL;
+    constexpr uint64_t K2 = 0x94D049BB133111EBULL;
+
+    auto mix = [](uint64_t h) {
+        h ^= h >> 30;
+        h *= K1;
+        h ^= h >> 27;
+        h *= K2;
+        return h ^ (h >> 31);
+    };
+
+    uint64_t h = seed ^ (data.size() * K0);
+    const char* p = data.data();
+    size_t n = data.size();
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        h = mix(h ^ word) + K0;
+    }
+    uint64_t tail = 0;
+    if (n != 0)
+        std::memcpy(&tail, p, n);
+    return mix(h ^ tail ^ (static_cast<uint64_t>(n) << 56));
+}
+
+bool equalsIgnoreCase(std::string_view lhs, std::string_view rhs) {
+    return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin(),
+        [](char l, char r) { return std::tolower(static_cast<unsigned char>(l)) == std::tolower(static_cast<unsigned char>(r)); });
+}
+
+// Finds the value of header `name` (case-insensitive) in a raw HTTP/RTSP message.
+// Only the header block is searched, the start line and the body are skipped.
+// The returned view points into `message`, it's empty if there's no such header.
+std::string_view findHeaderValue(std::string_view message, std::string_view name) {
+    size_t begin = message.find('\n');
+    while (begin != std::string_view::npos) {
+        begin += 1;
+        const size_t end = message.find('\n', begin);
+        auto line = message.substr(begin, end == std::string_view::npos ? end : end - begin);
+        if (trim(line).empty())
+            break;
+
+        auto colon = line.find(':');
+        if (colon != std::string_view::npos && equalsIgnoreCase(trim(line.substr(0, colon)), name))
+            return trim(line.substr(colon + 1));
+        begin = end;
+    }
+    return {};
+}
+
+// std::byteswap is C++23
+template<typename T>
+constexpr T byteswap(T value)
+{
+    static_assert(std::is_unsigned_v<T>, "byteswap works on unsigned integers");
+    if constexpr (sizeof(T) == 1) {
+        return value;
+    }
+    else if constexpr (sizeof(T) == 2) {
+        return static_cast<T>(value << 8 | value >> 8);
+    }
+    else if constexpr (sizeof(T) == 4) {
+        value = (value & 0x0000FFFFU) << 16 | (value & 0xFFFF0000U) >> 16;
+        return (value & 0x00FF00FFU) << 8 | (value & 0xFF00FF00U) >> 8;
+    }
+    else {
+        static_assert(sizeof(T) == 8);
+        value = (value & 0x00000000FFFFFFFFULL) << 32 | (value & 0xFFFFFFFF00000000ULL) >> 32;
+        value = (value & 0x0000FFFF0000FFFFULL) << 16 | (value & 0xFFFF0000FFFF0000ULL) >> 16;
+        return (value & 0x00FF00FF00FF00FFULL) << 8 | (value & 0xFF00FF00FF00FF00ULL) >> 8;
+    }
+}
+
+// Writes `value` to `out` in network byte order (RTP, Raysharp), `out` needn't be aligned
+template<typename T>
+void storeBigEndian(char* out, T value)
+{
+    static_assert(std::is_unsigned_v<T>, "storeBigEndian works on unsigned integers");
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        out[i] = static_cast<char>(value >> (8 * (sizeof(T) - 1 - i)));
+    }
+}
+
+// Reads a `T` stored least significant byte first, `p` needn't be aligned
+template<typename T>
+T loadLittleEndian(const char* p)
+{
+    static_assert(std::is_unsigned_v<T>, "loadLittleEndian works on unsigned integers");
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        value |= static_cast<T>(static_cast<T>(static_cast<uint8_t>(p[i])) << (8 * i));
+    }
+    return value;
+}
+
+// Writes `value` to `out` least significant byte first (our own file formats)
+template<typename T>
+void storeLittleEndian(char* out, T value)
+{
+    static_assert(std::is_unsigned_v<T>, "storeLittleEndian works on unsigned integers");
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        out[i] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+// Reads a big-endian bit stream (RTP, Raysharp metadata, H.264/H.265 SPS/PPS).
+// Bits are served from a 64-bit cache that is refilled a whole word at a time.
+// Reading past the end doesn't assert: it returns 0 and sets the sticky overflow() flag,
+// so a whole structure can be decoded first and checked once.
 template<typename T>
 class BitStream
 {
+	static_assert(sizeof(T) == 1, "BitStream reads bytes");
+
 public:
 	/// Constructs new BitStream object from buffer.
 	explicit BitStream(std::span<T> buffer) :
-		m_buffer(buffer),
-		m_position(buffer.begin()),
-		m_bitsLeft(8)
+		m_buffer(buffer)
 	{}
 
 	/// Skips specified number of bits from stream.
-	void skip(int count)
+	void skip(size_t count)
 	{
-		m_bitsLeft -= count;
+		if (count <= m_cacheBits) {
+			consume(count);
+			return;
+		}
 
-		while (m_bitsLeft <= 0)
-		{
-			++m_position;
-			m_bitsLeft += 8;
+		count -= m_cacheBits;
+		m_cache = 0;
+		m_cacheBits = 0;
+		const size_t bytes = count / 8;
+		if (bytes > m_buffer.size() - m_next) {
+			m_next = m_buffer.size();
+			m_overflow = true;
+			return;
 		}
+		m_next += bytes;
+		popBits(count % 8);
+	}
+
+	/// Pops N bits from stream, 1 <= N <= 32.
+	template<unsigned N>
+	uint32_t pop()
+	{
+		static_assert(N >= 1 && N <= 32, "up to 32 bits can be popped at once");
+		return static_cast<uint32_t>(popBits(N));
 	}
 
 	/// Pops number of bits from stream.
 	/// Maximum 32 bits integers are supported.
 	uint32_t pop(int count)
 	{
-		static const uint32_t MASK[33] =
-		{ 0x00,
-			0x01,		0x03,		0x07,		0x0f,
-			0x1f,		0x3f,		0x7f,		0xff,
-			0x1ff,		0x3ff,		0x7ff,		0xfff,
-			0x1fff,		0x3fff,		0x7fff,		0xffff,
-			0x1ffff,	0x3ffff,	0x7ffff,	0xfffff,
-			0x1fffff,	0x3fffff,	0x7fffff,	0xffffff,
-			0x1ffffff,	0x3ffffff,	0x7ffffff,	0xfffffff,
-			0x1fffffff,	0x3fffffff,	0x7fffffff,	0xffffffff };
-		int shift = 0;
-		uint32_t result = 0;
-
-		assert(count <= 32);
-
-		while (count > 0)
-		{
-			if (m_position == m_buffer.end())
-			{
-				// Error in protocol.
-				assert(0);
-				break;
-			}
-
-			if ((shift = m_bitsLeft - count) >= 0)
-			{
-				// more in the buffer than requested
-				result |= (*m_position >> shift) & MASK[count];
-				m_bitsLeft -= count;
-				if (m_bitsLeft == 0)
-				{
-					++m_position;
-					m_bitsLeft = 8;
-				}
-				return result;
-			}
-			else
-			{
-				// less in the buffer than requested
-				result |= (*m_position & MASK[m_bitsLeft]) << -shift;
-				count -= m_bitsLeft;
-				++m_position;
-				m_bitsLeft = 8;
-			}
+		if (count < 0 || count > 32) {
+			m_overflow = true;
+			return 0;
 		}
+		return static_cast<uint32_t>(popBits(static_cast<unsigned>(count)));
+	}
 
-		return result;
+	/// Unsigned Exp-Golomb code, ue(v)
+	uint32_t ue()
+	{
+		if (m_cacheBits < 32)
+			refill();
+		const auto zeros = static_cast<unsigned>(std::countl_zero(m_cache));
+		if (zeros > 31 || zeros >= m_cacheBits) {
+			m_overflow = true;
+			return 0;
+		}
+		consume(zeros);
+		return static_cast<uint32_t>(popBits(zeros + 1) - 1);
+	}
+
+	/// Signed Exp-Golomb code, se(v)
+	int32_t se()
+	{
+		const int64_t k = ue();
+		return static_cast<int32_t>(k & 1 ? (k + 1) / 2 : -(k / 2));
+	}
+
+	/// Some read went past the end of the buffer, the values read since then are 0
+	bool overflow() const
+	{
+		return m_overflow;
 	}
 
-	std::span<T>::iterator position() const
+	typename std::span<T>::iterator position() const
 	{
 		// Ensure we are called only on aligned byte.
-		assert(m_bitsLeft == 8);
-		return m_position;
+		assert(bitPosition() % 8 == 0);
+		return m_buffer.begin() + bitPosition() / 8;
 	}
 
 	std::size_t bitPosition() const
 	{
-		return (m_position - m_buffer.begin()) * 8 + (8 - m_bitsLeft);
+		return m_next * 8 - m_cacheBits;
+	}
+
+	std::size_t bitsLeft() const
+	{
+		return (m_buffer.size() - m_next) * 8 + m_cacheBits;
 	}
 
 private:
-	std::span<T>			m_buffer;
-	std::span<T>::iterator	m_position;
-	int						m_bitsLeft;
+	static constexpr uint64_t mask(unsigned bits)
+	{
+		return bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+	}
+
+	// Tops the cache up to at least 57 bits (unless the buffer ends)
+	void refill()
+	{
+		if (m_buffer.size() - m_next >= 8) {
+			uint64_t word;
+			std::memcpy(&word, m_buffer.data() + m_next, 8);
+			if constexpr (std::endian::native == std::endian::little)
+				word = util::byteswap(word);
+			const unsigned bytes = (64 - m_cacheBits) / 8;
+			// the bits of the partially taken byte are the same on the next refill
+			m_cache |= word >> m_cacheBits;
+			m_next += bytes;
+			m_cacheBits += bytes * 8;
+			return;
+		}
+		while (m_cacheBits <= 56 && m_next < m_buffer.size()) {
+			m_cache |= static_cast<uint64_t>(static_cast<uint8_t>(m_buffer[m_next++])) << (56 - m_cacheBits);
+			m_cacheBits += 8;
+		}
+	}
+
+	void consume(unsigned count)
+	{
+		m_cache = count >= 64 ? 0 : m_cache << count;
+		m_cacheBits -= count;
+	}
+
+	uint64_t popBits(unsigned count)
+	{
+		if (count == 0)
+			return 0;
+		if (m_cacheBits < count)
+			refill();
+		if (m_cacheBits < count) {
+			// Error in protocol.
+			m_overflow = true;
+			m_cache = 0;
+			m_cacheBits = 0;
+			m_next = m_buffer.size();
+			return 0;
+		}
+		const uint64_t result = (m_cache >> (64 - count)) & mask(count);
+		consume(count);
+		return result;
+	}
+
+	std::span<T>	m_buffer;
+	// next byte that isn't in the cache yet
+	size_t			m_next = 0;
+	// the next bit is the most significant one
+	uint64_t		m_cache = 0;
+	unsigned		m_cacheBits = 0;
+	bool			m_overflow = false;
 };
 }
\ No newline at end of file
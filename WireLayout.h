@@ -0,0 +1,167 @@
+#pragma once
+
+#include "Utility.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+// Compile-time descriptions of packed big-endian structs, so a decoder is declared instead of hand-written:
+//
+//     template<> struct wire::LayoutOf<Point> { using type = wire::Layout<Point, wire::Field<&Point::x>, wire::Field<&Point::y>>; };
+//     auto point = wire::decode<Point>(bytes);
+//
+// Every field is one memcpy and one byte swap at an offset known at compile time.
+namespace wire {
+
+template<typename S>
+struct LayoutOf;
+
+template<typename T>
+concept HasLayout = requires { typename LayoutOf<T>::type; };
+
+namespace detail {
+
+template<size_t Size>
+using unsigned_t = std::conditional_t<Size == 1, uint8_t, std::conditional_t<Size == 2, uint16_t, std::conditional_t<Size == 4, uint32_t, uint64_t>>>;
+
+template<typename T>
+T load(const char* p) {
+    if constexpr (HasLayout<T>) {
+        return LayoutOf<T>::type::decodeUnchecked(p);
+    }
+    else {
+        static_assert(std::is_integral_v<T> || std::is_enum_v<T>, "a field is an integer, an enum, a described struct or an array of them");
+        static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8);
+        unsigned_t<sizeof(T)> raw;
+        std::memcpy(&raw, p, sizeof(raw));
+        if constexpr (std::endian::native == std::endian::little)
+            raw = util::byteswap(raw);
+        return static_cast<T>(raw);
+    }
+}
+
+template<typename T>
+struct MemberOf;
+
+template<typename S, typename T>
+struct MemberOf<T S::*>
+{
+    using struct_t = S;
+    using value_t = T;
+};
+
+}
+
+// Wire size of a field type: the struct size for integers, the layout size for described structs
+template<typename T>
+constexpr size_t wireSize() {
+    if constexpr (std::is_array_v<T>)
+        return std::extent_v<T> * wireSize<std::remove_extent_t<T>>();
+    else if constexpr (HasLayout<T>)
+        return LayoutOf<T>::type::size;
+    else
+        return sizeof(T);
+}
+
+// A data member, arrays are decoded element by element
+template<auto Member>
+struct Field
+{
+    using struct_t = typename detail::MemberOf<decltype(Member)>::struct_t;
+    using value_t = typename detail::MemberOf<decltype(Member)>::value_t;
+    static constexpr size_t size = wireSize<value_t>();
+
+    static void decode(struct_t& s, const char* p) {
+        if constexpr (std::is_array_v<value_t>) {
+            using element_t = std::remove_extent_t<value_t>;
+            for (size_t i = 0; i < std::extent_v<value_t>; ++i)
+                (s.*Member)[i] = detail::load<element_t>(p + i * wireSize<element_t>());
+        }
+        else {
+            s.*Member = detail::load<value_t>(p);
+        }
+    }
+};
+
+// Bytes that aren't decoded (reserved)
+template<size_t Size>
+struct Skip
+{
+    static constexpr size_t size = Size;
+
+    template<typename S>
+    static void decode(S&, const char*) {}
+};
+
+// Fields a member pointer can't describe (bit fields): `Decode(s, p)` reads `Size` bytes
+template<size_t Size, auto Decode>
+struct Custom
+{
+    static constexpr size_t size = Size;
+
+    template<typename S>
+    static void decode(S& s, const char* p) {
+        Decode(s, p);
+    }
+};
+
+template<typename S, typename... Fields>
+struct Layout
+{
+    static constexpr size_t size = (Fields::size + ...);
+
+    // `p` must point to at least `size` bytes
+    static S decodeUnchecked(const char* p) {
+        S s{};
+        decodeFields(s, p, std::index_sequence_for<Fields...>{});
+        return s;
+    }
+
+private:
+    template<size_t... I>
+    static void decodeFields(S& s, const char* p, std::index_sequence<I...>) {
+        (Fields::decode(s, p + offset<I>()), ...);
+    }
+
+    template<size_t I>
+    static constexpr size_t offset() {
+        constexpr size_t sizes[] = { Fields::size... };
+        size_t result = 0;
+        for (size_t i = 0; i < I; ++i)
+            result += sizes[i];
+        return result;
+    }
+};
+
+template<HasLayout S>
+constexpr size_t sizeOf = LayoutOf<S>::type::size;
+
+// Nothing if `data` is shorter than the layout, bytes after it are ignored
+template<HasLayout S>
+std::optional<S> decode(std::span<const char> data) {
+    if (data.size() < sizeOf<S>)
+        return {};
+    return LayoutOf<S>::type::decodeUnchecked(data.data());
+}
+
+// Calls f(const S&) for each of `count` records that are `stride` bytes apart (stride >= the layout size).
+// Stops at the end of `data`, returns how many records were decoded.
+template<HasLayout S, typename F>
+size_t decodeEach(std::span<const char> data, size_t count, size_t stride, F&& f) {
+    if (stride < sizeOf<S>)
+        return 0;
+    const size_t available = data.size() < sizeOf<S> ? 0 : (data.size() - sizeOf<S>) / stride + 1;
+    count = std::min(count, available);
+    for (size_t i = 0; i < count; ++i) {
+        f(LayoutOf<S>::type::decodeUnchecked(data.data() + i * stride));
+    }
+    return count;
+}
+
+}
@@ -1,8 +1,18 @@
 ﻿#include "Http.h"
 #include "Rtsp.h"
+#include "RtspSession.h"
 #include "Generator.h"
 #include "ReassemblyHelper.h"
+#include "IoContextPool.h"
+#include "Rtp.h"
+#include "RtpAnalyzer.h"
+#include "Rtcp.h"
+#include "H26x.h"
 #include "Raysharp.h"
+#include "DetectionStore.h"
+#include "LoadGenerator.h"
+#include "Bundle.h"
+#include "CaptureWatcher.h"
 
 #include <fstream>
 #include <ranges>
@@ -10,14 +20,19 @@
 #include <variant>
 #include <algorithm>
 #include <unordered_set>
+#include <deque>
+#include <queue>
 #include <coroutine>
 #include <functional>
+#include <atomic>
 
 #include <boost/asio/co_spawn.hpp>
 #include <boost/asio/detached.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/asio/redirect_error.hpp>
 #include <boost/asio/write.hpp>
 #include <boost/beast/core.hpp>
@@ -25,6 +40,10 @@
 #include <boost/beast/version.hpp>
 #include <boost/asio/as_tuple.hpp>
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 #pragma warning( push )
 #pragma warning( disable : 4996)
 #include <Packet.h>
@@ -32,10 +51,13 @@
 #include <TcpLayer.h>
 #include <HttpLayer.h>
 #include <IPv4Layer.h>
+#include <IPv6Layer.h>
+#include <UdpLayer.h>
 #pragma warning( pop )
 
 namespace net = boost::asio;
 using tcp = net::ip::tcp;
+using udp = net::ip::udp;
 namespace beast = boost::beast;
 namespace http = beast::http;
 
@@ -83,323 +105,977 @@ struct Data
     rtsp_stream_map_SP_t rtspStreams;
 };
 
-Data prepareData(std::string inputPath) {
+using detection_store_SP_t = std::shared_ptr<const DetectionStore>;
+
+// Decodes the Raysharp metadata of every recorded stream once
+detection_store_SP_t buildDetections(const RtspStreamCatalog& catalog) {
+    auto store = std::make_shared<DetectionStore>();
+    for (auto&& [uri, stream] : catalog.streams) {
+        store->add(uri, stream.m_packets);
+    }
+    store->finalize();
+    return store;
+}
+
+// Everything the servers answer from, published as a whole: a session never mixes two captures.
+// A reload swaps the pointer; sessions hold the parts they use, so they finish on the catalogs they started with.
+struct Snapshot
+{
+    Data data;
+    detection_store_SP_t detections;
+};
+
+using snapshot_SP_t = std::shared_ptr<const Snapshot>;
+using live_snapshot_t = std::atomic<snapshot_SP_t>;
+
+// Queries of the detection store over HTTP: GET /_pcap/detections?<DetectionStore::Query>.
+// The prefix is reserved, recorded exchanges under it aren't served.
+constexpr std::string_view DETECTIONS_PATH = "/_pcap/detections";
+
+// The path of `target` is exactly DETECTIONS_PATH, whatever the query
+bool isDetectionsTarget(std::string_view target) {
+    return target.substr(0, target.find('?')) == DETECTIONS_PATH;
+}
+
+// Renders the answer into `head` and `body`, which must live until the response is written
+void answer_detections(const DetectionStore& detections, std::string_view target, std::string& head, std::string& body) {
+    auto question = target.find('?');
+    std::string error;
+    auto query = DetectionStore::Query::parse(question == std::string_view::npos ? std::string_view{} : target.substr(question + 1), error);
+    if (query)
+        body = detections.toJson(query->kind, detections.find(*query));
+    else
+        body = fmt::format("{{\"error\":\"{}\"}}", DetectionStore::jsonEscape(error));
+    head = fmt::format("HTTP/1.1 {}\r\nContent-Type: application/json\r\nContent-Length: {}\r\n", query ? "200 OK" : "400 Bad Request", body.size());
+}
+
+// Source and destination addresses of an IPv4 or IPv6 packet, empty if it has neither
+std::pair<std::string, std::string> ipAddresses(const pcpp::Packet& packet) {
+    if (auto* ipv4 = packet.getLayerOfType<pcpp::IPv4Layer>())
+        return { ipv4->getSrcIPAddress().toString(), ipv4->getDstIPAddress().toString() };
+    if (auto* ipv6 = packet.getLayerOfType<pcpp::IPv6Layer>())
+        return { ipv6->getSrcIPAddress().toString(), ipv6->getDstIPAddress().toString() };
+    return {};
+}
+
+Data prepareData(std::string inputPath, const CatalogOptions& options = {}) {
     ReassemblyHelper reassembly;
+    reassembly.dumpTo(options.dumpDirectory);
 
     pcpp::TcpReassembly tcpReasembly{ onTcpMessageReady, &reassembly, onTcpConnectionStart, onTcpConnectionEnd };
 
     for (pcpp::Packet packet : generatePackets(inputPath)) {
+        // RTP/RTCP of streams set up with client_port
+        if (auto* udpLayer = packet.getLayerOfType<pcpp::UdpLayer>()) {
+            std::string_view payload{ reinterpret_cast<const char*>(udpLayer->getLayerPayload()), udpLayer->getLayerPayloadSize() };
+            reassembly.onUdpPacket(udpLayer->getSrcPort(), udpLayer->getDstPort(), [&packet] { return ipAddresses(packet); }, payload,
+                util::convertToTimestampUs(packet.getRawPacket()->getPacketTimeStamp()));
+            continue;
+        }
         auto res = tcpReasembly.reassemblePacket(packet);
     }
 
-    return { reassembly.getHttpRequests(), reassembly.getRtspStreams() };
+    return { reassembly.getHttpRequests(options), reassembly.getRtspStreams() };
 }
 
-net::awaitable<void> handle_http_session(tcp::socket socket, req_res_holder_SP_t http) {
-    for (;;) {
-        beast::error_code ec;  // Declare error_code inside the coroutine
-        beast::flat_buffer buffer;
+// A packet dump (see PacketDump.h) as a catalog of one stream named after the file, e.g. "/cam1.dump" -> "/cam1".
+// It has no RTSP steps, so it can be analyzed, queried and used as a generator template, but not served.
+Data loadDump(const std::filesystem::path& path) {
+    auto catalog = std::make_shared<RtspStreamCatalog>();
+    if (auto packets = dump::load(path)) {
+        RtspStream stream;
+        stream.m_uri = "/" + path.stem().string();
+        stream.m_packets = std::move(*packets);
+        auto uri = stream.m_uri;
+        catalog->streams[uri] = std::move(stream);
+    }
+    else {
+        std::cout << "Not a packet dump: " << path.string() << '\n';
+    }
+    catalog->finalize();
+    return { std::make_shared<ReqResHolder>(http_requests_vec_t{}), std::move(catalog) };
+}
 
-        http::request<http::string_body> req;
-        // The operation needs to co_await to wait for completion
-        co_await http::async_read(socket, buffer, req, net::redirect_error(net::use_awaitable, ec));
-        if (ec == http::error::end_of_stream)
-            break;
+// The catalogs from the bundle at `bundlePath` if it was made from this capture,
+// otherwise the capture is parsed and the bundle is (re)written for the next start.
+// A packet dump is loaded as it is.
+Data loadData(const std::string& inputPath, const CatalogOptions& options, const std::string& bundlePath) {
+    if (std::filesystem::path(inputPath).extension() == ".dump")
+        return loadDump(inputPath);
+    if (bundlePath.empty())
+        return prepareData(inputPath, options);
+
+    auto source = bundle::SourceId::of(inputPath);
+    if (!source) {
+        std::cout << "Can't read " << inputPath << '\n';
+        return prepareData(inputPath, options);
+    }
+    if (auto catalogs = bundle::load(bundlePath, *source, options)) {
+        std::cout << "Loaded " << bundlePath << '\n';
+        return { std::move(catalogs->httpRequests), std::move(catalogs->rtspStreams) };
+    }
+
+    auto data = prepareData(inputPath, options);
+    if (bundle::write(bundlePath, *source, *data.httpRequests, *data.rtspStreams))
+        std::cout << "Wrote " << bundlePath << '\n';
+    else
+        std::cout << "Can't write " << bundlePath << '\n';
+    return data;
+}
+
+// Connection reuse limits of the HTTP mock server
+struct HttpLimits
+{
+    // the response to the last one says "Connection: close"
+    std::size_t maxRequestsPerConnection = 10000;
+    // responses gathered into one write when the client pipelines
+    std::size_t maxPipelined = 64;
+    std::chrono::seconds idleTimeout{ 30 };
+    std::uint64_t maxBodySize = 1024 * 1024;
+};
+
+#ifndef __linux__
+// Blocking reads of the body store run here, not on the threads that serve the connections
+net::thread_pool& diskThreads() {
+    static net::thread_pool pool{ 2 };
+    return pool;
+}
+
+net::awaitable<size_t> read_stored_chunk(const BodyStore& store, uint64_t offset, std::span<char> chunk) {
+    co_return store.read(offset, chunk);
+}
+#endif
+
+// Sends a body moved to the BodyStore. On Linux it's sendfile(), the bytes don't leave the kernel,
+// otherwise the file is read in small chunks on the disk threads, so a connection never holds more than one chunk.
+// A client that doesn't take any of the body for `timeout` is dropped like an idle one.
+net::awaitable<bool> send_stored_body(beast::tcp_stream& stream, const BodyStore& store, BodyStore::Ref body, std::chrono::seconds timeout) {
+#ifdef __linux__
+    auto& socket = stream.socket();
+    socket.native_non_blocking(true);
+    // socket.async_wait() isn't covered by the timeout of the tcp_stream
+    net::steady_timer deadline(socket.get_executor());
+    off_t offset = static_cast<off_t>(body.offset);
+    uint64_t left = body.size;
+    while (left > 0) {
+        auto sent = ::sendfile(socket.native_handle(), store.fd(), &offset, static_cast<size_t>(left));
+        if (sent > 0) {
+            left -= static_cast<uint64_t>(sent);
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            deadline.expires_after(timeout);
+            deadline.async_wait([&socket](const boost::system::error_code& ec) {
+                if (!ec)
+                    socket.cancel();
+            });
+            beast::error_code ec;
+            co_await socket.async_wait(tcp::socket::wait_write, net::redirect_error(net::use_awaitable, ec));
+            deadline.cancel();
+            if (ec)
+                co_return false;
+            continue;
+        }
+        co_return false;
+    }
+    co_return true;
+#else
+    std::array<char, 64 * 1024> chunk;
+    uint64_t offset = body.offset;
+    uint64_t left = body.size;
+    while (left > 0) {
+        auto size = static_cast<size_t>(std::min<uint64_t>(left, chunk.size()));
+        auto read = co_await net::co_spawn(diskThreads(), read_stored_chunk(store, offset, { chunk.data(), size }), net::use_awaitable);
+        if (read == 0)
+            co_return false;
+        beast::error_code ec;
+        stream.expires_after(timeout);
+        co_await net::async_write(stream, net::buffer(chunk.data(), read), net::redirect_error(net::use_awaitable, ec));
         if (ec)
-            co_return;
+            co_return false;
+        offset += read;
+        left -= read;
+    }
+    co_return true;
+#endif
+}
 
-        auto reqres = (*http)[req.target()];
+net::awaitable<void> handle_http_session(tcp::socket socket, req_res_holder_SP_t http, detection_store_SP_t detections, HttpLimits limits) {
+    beast::tcp_stream stream{ std::move(socket) };
+    // lives as long as the connection, so pipelined bytes that came with the previous read aren't lost
+    beast::flat_buffer buffer;
+    std::optional<http::request_parser<http::string_body>> parser;
+    std::vector<net::const_buffer> wire;
+    wire.reserve(limits.maxPipelined * std::tuple_size_v<HttpResponse::wire_buffers_t>);
+    // responses rendered per request (detection queries), until they're written; a deque doesn't move them
+    std::deque<std::string> rendered;
+    // the Date line of the responses being written, copied once per write (see httpDateHeader())
+    std::string date;
+    std::size_t served = 0;
+    bool keepAlive = true;
 
-        auto& resp = reqres.response;
-        http::response<http::string_body> res{ static_cast<http::status>(resp.m_code), req.version() };
+    for (;;) {
+        // answer every request that is already buffered
+        date = httpDateHeader();
+        std::size_t pipelined = 0;
+        std::optional<BodyStore::Ref> storedBody;
+        while (keepAlive && !storedBody && pipelined < limits.maxPipelined && buffer.size() > 0) {
+            if (!parser) {
+                parser.emplace();
+                parser->eager(true);
+                parser->body_limit(limits.maxBodySize);
+            }
+
+            beast::error_code ec;
+            auto consumed = parser->put(buffer.data(), ec);
+            buffer.consume(consumed);
+            if (ec == http::error::need_more)
+                break;
+            if (ec)
+                co_return;
+            if (!parser->is_done())
+                continue;
+
+            auto& req = parser->get();
+            keepAlive = req.keep_alive() && ++served < limits.maxRequestsPerConnection;
+            if (detections && isDetectionsTarget(req.target())) {
+                auto& head = rendered.emplace_back();
+                auto& body = rendered.emplace_back();
+                answer_detections(*detections, req.target(), head, body);
+                auto response = HttpResponse::wire(head, body, date, keepAlive);
+                wire.insert(wire.end(), response.begin(), response.end());
+                parser.reset();
+                ++pipelined;
+                continue;
+            }
 
-        for (auto& [header, val] : resp.m_headers) {
-            res.set(header, val);
-            res.body() = resp.m_body;
+            auto header = [&req](std::string_view name) { return std::string_view{ req[name] }; };
+            auto* reqres = http->find(req.method_string(), req.target(), header, req.body());
+
+            // the response is pre-rendered, only Date and Connection are added here
+            auto response = reqres ? reqres->response.wire(date, keepAlive) : HttpResponse::notFound(date, keepAlive);
+            wire.insert(wire.end(), response.begin(), response.end());
+            parser.reset();
+            ++pipelined;
+            // a large body isn't in memory: send what's gathered, then stream it
+            if (reqres && reqres->response.m_storedBody)
+                storedBody = reqres->response.m_storedBody;
         }
 
-        co_await http::async_write(socket, res, net::redirect_error(net::use_awaitable, ec));
+        if (!wire.empty()) {
+            beast::error_code ec;
+            stream.expires_after(limits.idleTimeout);
+            co_await net::async_write(stream, wire, net::redirect_error(net::use_awaitable, ec));
+            if (ec)
+                co_return;
+            wire.clear();
+            rendered.clear();
+        }
+        if (storedBody) {
+            if (!co_await send_stored_body(stream, *http->bodyStore(), *storedBody, limits.idleTimeout))
+                co_return;
+        }
+        if (!keepAlive)
+            break;
+        if (storedBody || pipelined == limits.maxPipelined)
+            continue;
+
+        beast::error_code ec;
+        stream.expires_after(limits.idleTimeout);
+        auto size = co_await stream.async_read_some(buffer.prepare(16 * 1024), net::redirect_error(net::use_awaitable, ec));
+        if (ec == net::error::eof)
+            break;
         if (ec)
             co_return;
+        buffer.commit(size);
     }
 
     beast::error_code ec;  // Declare a new error_code for the shutdown operation
-    socket.shutdown(tcp::socket::shutdown_send, ec);
+    stream.socket().shutdown(tcp::socket::shutdown_send, ec);
     // Handle the shutdown error if needed
 }
 
-net::awaitable<void> http_listener(tcp::endpoint endpoint, req_res_holder_SP_t http) {
+// Accepts the next connection on the context that should own its session:
+// the acceptor's own one with SO_REUSEPORT, otherwise the next context of the pool.
+net::awaitable<tcp::socket> accept_pinned(tcp::acceptor& acceptor, IoContextPool& pool, beast::error_code& ec) {
+    if constexpr (IoContextPool::hasReusePort) {
+        co_return co_await acceptor.async_accept(net::redirect_error(net::use_awaitable, ec));
+    }
+    else {
+        co_return tcp::socket{ co_await acceptor.async_accept(pool.next(), net::redirect_error(net::use_awaitable, ec)) };
+    }
+}
+
+// Every new connection is served from the snapshot that is current when it's accepted
+net::awaitable<void> http_listener(tcp::acceptor acceptor, IoContextPool& pool, const live_snapshot_t& live, HttpLimits limits) {
     beast::error_code ec; // Declare error_code before use
-    auto executor = co_await net::this_coro::executor;
-    tcp::acceptor acceptor(executor, endpoint);
 
     for (;;) {
-        tcp::socket socket = co_await acceptor.async_accept(net::redirect_error(net::use_awaitable, ec));
+        tcp::socket socket = co_await accept_pinned(acceptor, pool, ec);
         if (ec)
             co_return;
 
-        net::co_spawn(executor, handle_http_session(std::move(socket), http), net::detached);
+        auto executor = socket.get_executor();
+        auto snapshot = live.load(std::memory_order_acquire);
+        net::co_spawn(executor, handle_http_session(std::move(socket), snapshot->data.httpRequests, snapshot->detections, limits), net::detached);
     }
 }
 
-using data_t = std::array<char, 1024>;
-Generator<std::string> getData(std::string filename) {
-    std::ifstream file(filename, std::ios::binary);
-    std::string data;
-    std::string line;
-    static const std::string_view DELIM = "<--__-->";
-
-    if (!file.is_open()) {
-        std::cout << "Can't open file: " << filename << '\n';
-        co_return;
+// State of one RTSP client connection, shared by the request loop and the media sender
+struct RtspConnection
+{
+    explicit RtspConnection(tcp::socket socket_) :
+        socket(std::move(socket_)),
+        writeDone(socket.get_executor())
+    {
+        writeDone.expires_at(net::steady_timer::time_point::max());
     }
-    while (file.is_open() && !file.eof()) {
-        while (std::getline(file, line, '`')) {
-            if (!line.ends_with(DELIM)) {
-                data += line + '`';
-                continue;
-            }
 
-            data += line.substr(0, line.size() - DELIM.size());
-            co_yield data;
-            data.clear();
-        }
+    tcp::socket socket;
+    std::optional<RtspSession> session;
+    // bumped by PLAY/PAUSE/TEARDOWN, a sender started for an older value stops
+    uint64_t playback = 0;
+    // a response and a batch of media must not interleave on the socket
+    bool isWriting = false;
+    net::steady_timer writeDone;
+};
+using shared_connection_t = std::shared_ptr<RtspConnection>;
+
+// async_write that waits for the other writer of the connection to finish first
+template<typename Buffers>
+net::awaitable<boost::system::error_code> write_exclusive(RtspConnection& connection, const Buffers& buffers) {
+    boost::system::error_code ec;
+    while (connection.isWriting) {
+        co_await connection.writeDone.async_wait(net::redirect_error(net::use_awaitable, ec));
     }
+    connection.isWriting = true;
+    co_await net::async_write(connection.socket, buffers, net::redirect_error(net::use_awaitable, ec));
+    connection.isWriting = false;
+    connection.writeDone.cancel_one();
+    co_return ec;
 }
-Generator<std::string> getData2(std::string filename) {
-    std::ifstream file(filename, std::ios::binary);
-    std::string data;
 
-    if (!file.is_open()) {
-        std::cout << "Can't open file: " << filename << '\n';
+// Sends the recorded packets with their recorded timing, starting from the session cursor.
+// The packets are in arrival order (see RtspStreamCatalog::finalize), so no delay is negative.
+// All packets that are due are sent with one gather write, the bytes aren't copied.
+// A virtual camera gets its own RTP headers from a scratch buffer, the payloads are still sent from the recording.
+// Stops when the playback of the connection changes (PAUSE, TEARDOWN, another PLAY),
+// the cursor is kept in the session, so the next PLAY resumes from there.
+// `stream` shares the ownership of its catalog, which stays alive until the last packet is sent.
+net::awaitable<void> start_transferring_video(shared_connection_t connection, std::shared_ptr<const RtspStream> stream, size_t from) {
+    const auto playback = connection->playback;
+    auto isCurrent = [&connection, playback] {
+        return connection->playback == playback && connection->session;
+    };
+    // the session the cursor belongs to, a new DESCRIBE/SETUP of another stream replaces it
+    const std::string sessionId{ connection->session->sessionId() };
+    auto isSameSession = [&connection, &sessionId] {
+        return connection->session && connection->session->sessionId() == sessionId;
+    };
+
+    auto& store = stream->m_packets;
+    auto& packets = store.packets();
+    if (from >= packets.size())
         co_return;
-    }
-    while (std::getline(file, data)) {
-        co_yield data;
+
+    net::steady_timer timer(connection->socket.get_executor());
+    const auto start = std::chrono::steady_clock::now();
+    const auto firstArrival = packets[from].arrival;
+    std::vector<std::array<char, 4>> headers;
+    // interleaved + rewritten RTP header of every packet of a batch of a virtual camera
+    std::vector<std::array<char, 4 + rtp::HEADER_SIZE>> scratch;
+    const bool isVirtual = connection->session->camera().has_value();
+    std::vector<net::const_buffer> batch;
+
+    for (size_t i = from; i < packets.size();) {
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        size_t end = i;
+        while (end < packets.size() && packets[end].arrival - firstArrival <= static_cast<uint64_t>(elapsed))
+            ++end;
+
+        if (end == i) {
+            timer.expires_after(std::chrono::microseconds(packets[i].arrival - firstArrival - elapsed));
+            co_await timer.async_wait(net::use_awaitable);
+            if (!isCurrent())
+                co_return;
+            continue;
+        }
+
+        batch.clear();
+        if (isVirtual) {
+            // only the 12-byte RTP headers are rewritten, the payloads are sent from the shared recording;
+            // RTCP isn't sent, its reports describe the recorded SSRCs
+            scratch.resize(end - i);
+            for (size_t j = i; j < end; ++j) {
+                auto data = store.data(packets[j]);
+                auto& header = scratch[j - i];
+                if (!PacketStore::isRtp(packets[j].channel) || !connection->session->rewriteRtpHeader(packets[j].channel, data, header.data() + 4))
+                    continue;
+                auto interleaved = PacketStore::interleavedHeader(packets[j]);
+                std::copy(interleaved.begin(), interleaved.end(), header.begin());
+                batch.push_back(net::buffer(header));
+                batch.push_back(net::buffer(data.substr(rtp::HEADER_SIZE)));
+            }
+        }
+        else {
+            headers.clear();
+            for (size_t j = i; j < end; ++j) {
+                headers.push_back(PacketStore::interleavedHeader(packets[j]));
+            }
+            for (size_t j = i; j < end; ++j) {
+                batch.push_back(net::buffer(headers[j - i]));
+                batch.push_back(net::buffer(store.data(packets[j])));
+            }
+        }
+
+        boost::system::error_code ec;
+        if (!batch.empty())
+            ec = co_await write_exclusive(*connection, batch);
+        if (ec)
+            co_return;
+        // PAUSE may have come while the write waited or was in progress: what was sent is sent,
+        // so the next PLAY resumes after it
+        i = end;
+        if (isSameSession())
+            connection->session->advance(i);
+        if (!isCurrent())
+            co_return;
     }
 }
 
-using namespace std::chrono_literals;
-net::awaitable<void> sleep_for(std::chrono::milliseconds duration) {
-    auto executor = co_await net::this_coro::executor;
-    net::steady_timer timer(executor);
-    timer.expires_after(duration);
-    co_await timer.async_wait(net::use_awaitable);
-}
+// Answers one complete RTSP request. Returns false if the connection should be closed.
+net::awaitable<bool> handle_rtsp_request(shared_connection_t connection, const rtsp_stream_map_SP_t& rtsp, std::string_view request) {
+    PatternSeeker parser{ request };
+    static std::string_view methods[] = { "OPTIONS", "DESCRIBE", "SETUP", "PLAY", "TEARDOWN", "PAUSE", "GET_PARAMETER", "SET_PARAMETER" };
+    bool res = std::ranges::any_of(methods, [&parser](auto&& method) { return parser.startsWith(method); });
+    if (!res)
+        co_return true;
+
+    auto method = parser.extract(" ").to_string_view();
+    std::cout << "Got " << method << '\n';
+
+    auto url = parser.extract("rtsp://", " RTSP/1.0");
+    url.to("/", move_before);
+    auto uri = url.to_string_view();
+    if (uri.empty()) {
+        std::cout << "uri is missing\n";
+        co_return true;
+    }
+    auto [stream, camera] = rtsp->resolve(uri);
+    if (!stream) {
+        std::cout << "can't find this uri: " << uri << '\n';
+        co_return true;
+    }
+    // a virtual camera stays itself when the client follows the recorded Content-Base
+    auto& session = connection->session;
+    if (!session || &session->stream() != stream || (camera && session->camera() != camera)) {
+        session.emplace(*stream, camera);
+        ++connection->playback;
+    }
 
-using shared_socket_t = std::shared_ptr<tcp::socket>;
-net::awaitable<void> start_transferring_video(shared_socket_t socket, std::string filename) {
-    for (auto&& data : getData(filename)) {
-        co_await socket->async_write_some(net::buffer(data), net::use_awaitable);
-        co_await sleep_for(10ms);
+    auto cseq = static_cast<uint32_t>(PatternSeeker(util::findHeaderValue(request, "CSeq")).takeUInt64(0));
+    auto* step = session->match(method, uri, cseq);
+    if (!step) {
+        std::cout << "Wrong command, there's no " << method << " in the recording\n";
+        co_return true;
     }
-}
 
-using shared_socket_t = std::shared_ptr<tcp::socket>;
-net::awaitable<void> start_transferring_video(shared_socket_t socket, std::vector<std::string> payload) {
-    for (auto&& data : payload) {
-        co_await socket->async_write_some(net::buffer(data), net::use_awaitable);
-        co_await sleep_for(5ms);
+    // the sender of the previous PLAY stops before it writes anything else
+    if (method == "PLAY" || method == "PAUSE" || method == "TEARDOWN")
+        ++connection->playback;
+
+    // the PLAY response tells where the playback starts
+    size_t from = 0;
+    if (method == "PLAY")
+        from = session->play(parseNptStart(util::findHeaderValue(request, "Range")));
+
+    if (co_await write_exclusive(*connection, session->response(*step, cseq)))
+        co_return false;
+
+    if (method == "PLAY") {
+        net::co_spawn(connection->socket.get_executor(), start_transferring_video(connection, std::shared_ptr<const RtspStream>(rtsp, stream), from), net::detached);
     }
+    co_return true;
 }
 
-net::awaitable<void> handle_rtsp_session(shared_socket_t socket, rtsp_stream_map_SP_t rtsp) {
+net::awaitable<void> handle_rtsp_session(shared_connection_t connection, rtsp_stream_map_SP_t rtsp) {
+    RtspRequestFramer framer;
     for (;;) {
-        data_t data;
+        auto space = framer.prepare();
+        if (!space) {
+            std::cout << "RTSP request is too large, closing the connection\n";
+            break;
+        }
         boost::system::error_code ec;
-        co_await socket->async_read_some(net::buffer(data), net::redirect_error(net::use_awaitable, ec));
+        auto size = co_await connection->socket.async_read_some(*space, net::redirect_error(net::use_awaitable, ec));
         if (ec)
             break;
-        PatternSeeker parser{ {data.data(), data.size()}};
-        static std::string_view methods[] = { "OPTIONS", "DESCRIBE", "SETUP", "PLAY", "TEARDOWN", "PAUSE" };
-        bool res = std::ranges::any_of(methods, [&parser](auto&& method) { return parser.startsWith(method); });
-        if (!res)
-            continue;
-        
-        auto method = parser.extract(" ").to_string_view();
-        std::cout << "Got " << method << '\n';
-
-        auto url = parser.extract("rtsp://", " RTSP/1.0");
-        url.to("/", move_before);
-        auto uri = url.to_string();
-        if (uri.empty()) {
-            std::cout << "uri is missing\n";
-            continue;
-        }
-        auto streamIt = std::ranges::find_if(*rtsp, [uri](auto&& elem) { return uri.starts_with(elem.first); });
-        if (streamIt == rtsp->end()) {
-            std::cout << "can't find this uri: " << uri << '\n';
-            continue;
-        }
-        auto& step = streamIt->second.getNextStep();
-        if (step.method == method)
-            co_await socket->async_write_some(net::buffer(step.response), net::use_awaitable);
-        else
-            std::cout << "Wrong command, expected: " << step.method << ", actual " << method << '\n';
+        framer.commit(size);
 
-        if (method == "PLAY") {
-            //std::string path = replaceSymbols(uri) + ".txt";
-            net::co_spawn(socket->get_executor(), start_transferring_video(socket, streamIt->second.m_payload), net::detached);
+        // several pipelined requests may come in one read
+        while (auto request = framer.next()) {
+            if (!co_await handle_rtsp_request(connection, rtsp, *request)) {
+                ++connection->playback;
+                co_return;
+            }
+        }
+        if (framer.isOverflowed()) {
+            std::cout << "RTSP request is too large, closing the connection\n";
+            break;
         }
     }
+    // stops the sender
+    ++connection->playback;
 }
 
-net::awaitable<void> rtsp_listener(tcp::endpoint endpoint, rtsp_stream_map_SP_t rtsp) {
+net::awaitable<void> rtsp_listener(tcp::acceptor acceptor, IoContextPool& pool, const live_snapshot_t& live) {
     beast::error_code ec; // Declare error_code before use
-    auto executor = co_await net::this_coro::executor;
-    tcp::acceptor acceptor(executor, endpoint);
 
     for (;;) {
-        tcp::socket socket = co_await acceptor.async_accept(net::redirect_error(net::use_awaitable, ec));
+        tcp::socket socket = co_await accept_pinned(acceptor, pool, ec);
         if (ec)
             co_return;
 
-        auto shared_soket = std::make_shared<tcp::socket>(std::move(socket));
+        auto executor = socket.get_executor();
+        auto connection = std::make_shared<RtspConnection>(std::move(socket));
 
-        net::co_spawn(executor, handle_rtsp_session(shared_soket, rtsp), net::detached);
+        net::co_spawn(executor, handle_rtsp_session(connection, live.load(std::memory_order_acquire)->data.rtspStreams), net::detached);
     }
 }
 
-struct RTPHeaderExtension
-{
-    RTPHeaderExtension() :
-        definedByProfile(0)
-    {}
+// Runs both replay servers on a pool of `threads` io_contexts (0 - one per core).
+// Every session stays on the thread that accepted it.
+int runServers(const live_snapshot_t& live, std::size_t threads, const HttpLimits& limits) {
+    try {
+        IoContextPool pool{ threads };
+        net::signal_set signals(pool.get(0), SIGINT, SIGTERM);
+        signals.async_wait([&pool](auto, auto) { pool.stop(); });
+
+        const std::size_t acceptors = IoContextPool::hasReusePort ? pool.size() : 1;
+        for (std::size_t i = 0; i < acceptors; ++i) {
+            auto& ioc = pool.get(i);
+            net::co_spawn(ioc, http_listener(IoContextPool::makeAcceptor(ioc, { tcp::v4(), 80 }), pool, live, limits), net::detached);
+            net::co_spawn(ioc, rtsp_listener(IoContextPool::makeAcceptor(ioc, { tcp::v4(), 554 }), pool, live), net::detached);
+        }
+        std::cout << "Serving HTTP on :80 and RTSP on :554 with " << pool.size() << " threads\n";
+        pool.run();
+    }
+    catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    uint16_t		definedByProfile;
-    std::vector<char>	data;
-};
+    return EXIT_SUCCESS;
+}
 
-using rtp_header_opt_t = std::optional<RTPHeaderExtension> ;
+// Sends the packets of a shard of virtual cameras over UDP to `address`, each track to its port (see loadgen::Ports).
+// Due packets are built into pooled buffers, so once the pool has grown nothing is allocated per packet.
+net::awaitable<void> run_virtual_cameras(std::shared_ptr<const loadgen::Template> tmpl, std::vector<loadgen::VirtualCamera> cameras,
+    net::ip::address address, loadgen::Ports ports, std::atomic<uint64_t>& sent) {
+    // a shard that's far behind sends in bounded batches instead of growing the pool
+    constexpr size_t MAX_BATCH = 1024;
+    if (cameras.empty())
+        co_return;
 
-struct RtpPacketHeader
-{
-    RtpPacketHeader() :
-        isMark(false),
-        padding(false),
-        sequenceNumber(0),
-        payloadType(0),
-        rtpTimeStamp(0),
-        ssrc(0)
-    {}
-
-    bool			isMark;
-    bool			padding;
-    uint16_t		sequenceNumber;
-    uint8_t		    payloadType;
-    uint32_t		rtpTimeStamp;
-    uint32_t		ssrc;
-
-    rtp_header_opt_t	extension;
-};
+    auto executor = co_await net::this_coro::executor;
+    udp::socket socket(executor, udp::endpoint(address.is_v4() ? udp::v4() : udp::v6(), 0));
+    net::steady_timer timer(executor);
+    loadgen::BufferPool pool(tmpl->maxPacketSize());
 
-const int RTP_HEADER_SIZE = 12;
+    // cameras by the time of their next packet
+    using due_t = std::pair<util::timestamp_us, size_t>;
+    std::priority_queue<due_t, std::vector<due_t>, std::greater<>> queue;
+    for (size_t i = 0; i < cameras.size(); ++i) {
+        queue.push({ cameras[i].nextDue(), i });
+    }
 
-struct RTSPInterleavedHeader
-{
-    boost::uint8_t				magic;
-    boost::uint8_t				channel;
-    boost::endian::big_int16_t  length;
-};
+    struct Datagram
+    {
+        std::span<char> buffer;
+        size_t size;
+        udp::endpoint destination;
+    };
+    std::vector<Datagram> batch;
+    batch.reserve(MAX_BATCH);
+    const auto start = std::chrono::steady_clock::now();
+    for (;;) {
+        const auto elapsed = static_cast<util::timestamp_us>(
+            std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+        if (queue.top().first > elapsed) {
+            timer.expires_after(std::chrono::microseconds(queue.top().first - elapsed));
+            co_await timer.async_wait(net::use_awaitable);
+            continue;
+        }
 
-int main(int argc, char* argv[]) {
-    std::string inputPath;
-    if (argc < 2) {
-        inputPath = R"(C:\Users\irahm\Documents\GitHub\PcapParserVcpg\fd_meta.pcapng)";
-    }
-    else if (argc == 2) {
-        inputPath = argv[1];
-    }
-
-    auto [httpRequests, rtspStreams] = prepareData(inputPath);
-    auto& stream = rtspStreams->begin()->second;
-    std::vector<std::string> payload;
-    size_t await_data_size = 0;
-    for (auto&& data : stream.m_payload) {
-        if (data[0] == '$' && await_data_size == 0) {
-            payload.push_back(data);
-            auto rtsp_header = reinterpret_cast<const RTSPInterleavedHeader*>(data.data());
-            std::cout << rtsp_header->magic << " data.size: " << data.size()  << "\nrtsp packet length: " << rtsp_header->length << '\n';
-            await_data_size = rtsp_header->length - (data.size() - sizeof(RTSPInterleavedHeader));
-            std::cout << "await data length: " << await_data_size << '\n';
-            RtpPacketHeader rtpHeader;
-            std::span data_view = std::string_view{data.data() + sizeof(RTSPInterleavedHeader), data.size() - sizeof(RTSPInterleavedHeader)};
-            util::BitStream bs{ data_view };
-            const uint32_t version = bs.pop(2);
-            if (version != 2) {
-                std::cout << "version is not 2: " << version << '\n';
-                await_data_size = 0;
-                continue;
-            }
-            
-            // Padding bit
-            rtpHeader.padding = (bs.pop(1) != 0);
-
-            const bool hasExtension = (bs.pop(1) != 0);
-            std::cout << "has extension: " << hasExtension << '\n';
-            boost::uint32_t csrcCount = bs.pop(4);
-            std::cout << "csrc count: " << csrcCount << '\n';
-
-            // Marker bit
-            rtpHeader.isMark = (bs.pop(1) != 0);
-            std::cout << "marker bit: " << rtpHeader.isMark << '\n';
-
-            //payload type.
-            rtpHeader.payloadType = static_cast<boost::uint8_t>(bs.pop(7));
-            std::cout << "payload type: " << static_cast<int>(rtpHeader.payloadType) << '\n';
-
-            // Sequence Number.
-            rtpHeader.sequenceNumber = static_cast<boost::uint16_t>(bs.pop(16));
-            std::cout << "sequence number: " << rtpHeader.sequenceNumber << '\n';
-
-            // Timestamp.
-            rtpHeader.rtpTimeStamp = bs.pop(32);
-            std::cout << "timestamp: " << rtpHeader.rtpTimeStamp << '\n';
-
-            // SSRC
-            rtpHeader.ssrc = bs.pop(32);
-            std::cout << "ssrc: " << rtpHeader.ssrc << '\n';
-
-            // CSRC identifiers (optional).
-            const int csrcLen = csrcCount * 4;
-            std::cout << "csrc len: " << csrcLen << '\n';
-            
-            bs.skip(csrcLen * 8);
-
-            if (hasExtension)
-            {
-                rtpHeader.extension = RTPHeaderExtension{};
-
-                // defined by profile.
-                rtpHeader.extension.value().definedByProfile = static_cast<uint16_t>(bs.pop(16));
-
-                // Extension length in 8-bits units.
-                const boost::uint32_t extension_length = bs.pop(16) * 4;
-                std::cout << "extension_length: " << extension_length << '\n';
-                if (std::distance(bs.position(), data_view.end()) < static_cast<std::ptrdiff_t>(extension_length))
-                {
-                    std::cout << "Not enough data\n";
-                    continue;
-                }
-                rtpHeader.extension.value().data.assign(bs.position(), bs.position() + extension_length);
+        while (queue.top().first <= elapsed && batch.size() < MAX_BATCH) {
+            const auto camera = queue.top().second;
+            queue.pop();
+            uint8_t track = 0;
+            auto buffer = pool.acquire();
+            const auto size = cameras[camera].buildNext(buffer, track);
+            const auto port = static_cast<uint16_t>(ports.of(cameras[camera].id(), tmpl->tracks(), track));
+            batch.push_back({ buffer, size, udp::endpoint(address, port) });
+            queue.push({ cameras[camera].nextDue(), camera });
+        }
 
-                bs.skip(extension_length * 8);
-            }
-            
-            std::cout << "data_view: " << std::distance(bs.position(), data_view.end())<< '\n';
-            if (rtpHeader.payloadType == 108) {
-                Raysharp::parsedtPayload(bs);
-                return 0;
+        for (auto&& datagram : batch) {
+            boost::system::error_code ec;
+            co_await socket.async_send_to(net::buffer(datagram.buffer.data(), datagram.size), datagram.destination, net::redirect_error(net::use_awaitable, ec));
+            // a recorder that isn't listening yet (ICMP port unreachable) doesn't stop the cameras
+            if (!ec)
+                sent.fetch_add(1, std::memory_order_relaxed);
+            pool.release(datagram.buffer);
+        }
+        batch.clear();
+    }
+}
+
+// Host and port of "host:port", "[IPv6 address]:port" or a host alone (the port is `defaultPort` then).
+// An IPv6 address without brackets has several colons and is taken as a host alone.
+std::pair<std::string, std::string> splitHostPort(std::string_view destination, std::string_view defaultPort) {
+    if (destination.starts_with('[')) {
+        auto close = destination.find(']');
+        if (close != std::string_view::npos) {
+            auto rest = destination.substr(close + 1);
+            return { std::string{ destination.substr(1, close - 1) }, std::string{ rest.starts_with(':') ? rest.substr(1) : defaultPort } };
+        }
+    }
+    auto colon = destination.find(':');
+    if (colon == std::string_view::npos || destination.find(':', colon + 1) != std::string_view::npos)
+        return { std::string{ destination }, std::string{ defaultPort } };
+    return { std::string{ destination.substr(0, colon) }, std::string{ destination.substr(colon + 1) } };
+}
+
+// Emulates `options.cameras` cameras made from `stream` on a pool of `threads` io_contexts (0 - one per core).
+// The cameras are split between the threads and their starts are spread over one loop of the recording.
+// `destination` is the host (IPv4 or IPv6, see splitHostPort) and the first port; the SDP of every camera is written to `sdpDirectory` if it's set.
+int runGenerator(const RtspStream& stream, const loadgen::Options& options, const std::string& destination, const std::string& sdpDirectory,
+    std::size_t threads) {
+    try {
+        auto tmpl = std::make_shared<const loadgen::Template>(stream.m_packets, stream.sdp(), options);
+        if (tmpl->isEmpty()) {
+            std::cerr << "The template stream has no RTP packets\n";
+            return EXIT_FAILURE;
+        }
+
+        if (options.cameras > tmpl->maxCameras()) {
+            std::cerr << "At most " << tmpl->maxCameras() << " cameras have unique target ids with this template\n";
+            return EXIT_FAILURE;
+        }
+
+        IoContextPool pool{ threads };
+        const auto [host, port] = splitHostPort(destination, "5004");
+        udp::resolver resolver(pool.get(0));
+        const auto targets = resolver.resolve(host, port);
+        if (targets.empty()) {
+            std::cerr << "Can't resolve " << destination << '\n';
+            return EXIT_FAILURE;
+        }
+        const auto target = *targets.begin();
+        const loadgen::Ports ports{ target.endpoint().port(), options.portPerTrack };
+        if (ports.of(static_cast<uint32_t>(options.cameras - 1), tmpl->tracks(), static_cast<uint8_t>(tmpl->tracks() - 1)) + 1 > UINT16_MAX) {
+            std::cerr << "The ports of " << options.cameras << " cameras with " << tmpl->tracks()
+                      << " tracks don't fit after " << ports.basePort << ", use a lower port or --single-port\n";
+            return EXIT_FAILURE;
+        }
+
+        std::vector<std::vector<loadgen::VirtualCamera>> shards(pool.size());
+        for (size_t i = 0; i < options.cameras; ++i) {
+            const auto startOffset = tmpl->period() * i / options.cameras;
+            auto& camera = shards[i % shards.size()].emplace_back(*tmpl, static_cast<uint32_t>(i), options.seed, startOffset);
+            if (!sdpDirectory.empty()) {
+                std::ofstream(std::filesystem::path(sdpDirectory) / fmt::format("camera{}.sdp", i), std::ios::binary)
+                    << loadgen::cameraSdp(stream.sdp(), *tmpl, camera, target.endpoint().address().to_string(), ports);
             }
         }
+
+        std::atomic<uint64_t> sent{ 0 };
+        for (size_t i = 0; i < shards.size(); ++i) {
+            net::co_spawn(pool.get(i), run_virtual_cameras(tmpl, std::move(shards[i]), target.endpoint().address(), ports, sent), net::detached);
+        }
+
+        net::signal_set signals(pool.get(0), SIGINT, SIGTERM);
+        signals.async_wait([&pool](auto, auto) { pool.stop(); });
+
+        std::cout << fmt::format("Sending {} virtual cameras to {} ({}) with {} threads: {} packets per {:.1f} s loop\n", options.cameras,
+            destination, ports.perTrack ? "a port pair per track" : "one port, tell the cameras apart by SSRC", pool.size(),
+            tmpl->entries().size(), tmpl->period() / 1e6);
+        const auto start = std::chrono::steady_clock::now();
+        pool.run();
+
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << fmt::format("Sent {} packets, {:.0f} packets/s\n", sent.load(), sent.load() / std::max(seconds, 1e-3));
+    }
+    catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Prints loss/jitter/bitrate of every SSRC of every stream,
+// the per-second time series goes to `seriesPath` as CSV if it's set
+void analyzeRtp(const RtspStreamCatalog& catalog, const std::string& seriesPath) {
+    std::ofstream series;
+    if (!seriesPath.empty()) {
+        series.open(seriesPath);
+        series << "uri,ssrc,second,packets,bytes,kbps,frames,lost,jitter_ms\n";
+    }
+
+    for (auto&& [uri, stream] : catalog.streams) {
+        rtp::Analyzer::sample_sink_t sink;
+        if (series.is_open()) {
+            sink = [&series, &uri](const rtp::Analyzer::Sample& sample) {
+                series << fmt::format("{},{:08x},{},{},{},{:.1f},{},{},{:.3f}\n", uri, sample.ssrc, sample.second,
+                    sample.packets, sample.bytes, sample.bytes * 8 / 1000.0, sample.frames, sample.lost, sample.jitterMs);
+            };
+        }
+
+        rtp::Analyzer analyzer(rtp::sdpClockRates(stream.sdp()), std::move(sink));
+        const auto& store = stream.m_packets;
+        for (auto&& packet : store.packets()) {
+            if (PacketStore::isRtp(packet.channel))
+                analyzer.feed(store.data(packet), packet.arrival);
+        }
+        analyzer.finish();
+
+        std::cout << uri << '\n';
+        analyzer.forEach([](const rtp::Analyzer::Summary& summary) {
+            std::cout << "  " << summary << '\n';
+        });
+
+        auto clocks = rtcp::buildClockIndex(store, stream.sdp());
+        clocks.forEach([](uint32_t ssrc, uint32_t clockRate, const std::vector<rtcp::ClockIndex::SenderReport>& reports) {
+            if (reports.empty())
+                return;
+            const auto& first = reports.front();
+            std::cout << fmt::format("  SSRC {:08x}: {} sender reports, {} Hz, RTP {} = {}.{:06} s since epoch\n", ssrc, reports.size(),
+                clockRate, first.rtpTimestamp, first.wallclock / 1'000'000, first.wallclock % 1'000'000);
+        });
+    }
+}
+
+// Prints the access units and keyframes of every video track,
+// the first track is written to `annexBPath` as an Annex-B elementary stream if it's set
+void analyzeVideo(const RtspStreamCatalog& catalog, const std::string& annexBPath) {
+    bool isWritten = annexBPath.empty();
+    for (auto&& [uri, stream] : catalog.streams) {
+        for (auto&& [channel, video] : h26x::depacketize(stream.m_packets, stream.sdp())) {
+            std::cout << fmt::format("{} channel {}: {}, {} access units, {} keyframes, {} corrupted\n", uri, channel,
+                video.codec() == h26x::Codec::H264 ? "H.264" : "H.265", video.units().size(), video.keyframes().size(), video.corrupted());
+            if (isWritten)
+                continue;
+            std::ofstream out(annexBPath, std::ios::binary);
+            video.writeAnnexB(out);
+            isWritten = true;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::string inputPath = R"(C:\Users\irahm\Documents\GitHub\PcapParserVcpg\fd_meta.pcapng)";
+    bool serve = false;
+    std::size_t threads = 0;
+    CatalogOptions catalogOptions;
+    HttpLimits httpLimits;
+    std::string rtpSeriesPath;
+    std::string videoPath;
+    std::optional<std::string> detectionQuery;
+    loadgen::Options generatorOptions;
+    std::string generatorTarget = "127.0.0.1:5004";
+    std::string generatorSdpDirectory;
+    std::string generatorUri;
+    bool generate = false;
+    std::vector<std::string> fanOuts;
+    std::string bundlePath;
+    std::chrono::milliseconds watchInterval{ 0 };
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--serve") {
+            serve = true;
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            threads = PatternSeeker(argv[++i]).takeUInt64(0);
+        }
+        else if (arg == "--match-query" && i + 1 < argc) {
+            auto names = util::split(argv[++i], ',');
+            catalogOptions.fingerprint.queryParams.insert(catalogOptions.fingerprint.queryParams.end(), names.begin(), names.end());
+        }
+        else if (arg == "--match-header" && i + 1 < argc) {
+            auto names = util::split(argv[++i], ',');
+            catalogOptions.fingerprint.headers.insert(catalogOptions.fingerprint.headers.end(), names.begin(), names.end());
+        }
+        else if (arg == "--max-keepalive-requests" && i + 1 < argc) {
+            httpLimits.maxRequestsPerConnection = std::max<std::size_t>(1, PatternSeeker(argv[++i]).takeUInt64(1));
+        }
+        else if (arg == "--idle-timeout" && i + 1 < argc) {
+            httpLimits.idleTimeout = std::chrono::seconds{ PatternSeeker(argv[++i]).takeUInt64(30) };
+        }
+        else if (arg == "--ignore-body") {
+            catalogOptions.fingerprint.body = false;
+        }
+        else if (arg == "--body-store" && i + 1 < argc) {
+            catalogOptions.bodyStorePath = argv[++i];
+        }
+        else if (arg == "--generate" && i + 1 < argc) {
+            generatorOptions.cameras = std::max<std::size_t>(1, PatternSeeker(argv[++i]).takeUInt64(1));
+            generate = true;
+        }
+        else if (arg == "--generate-to" && i + 1 < argc) {
+            generatorTarget = argv[++i];
+        }
+        else if (arg == "--generate-sdp" && i + 1 < argc) {
+            generatorSdpDirectory = argv[++i];
+        }
+        else if (arg == "--single-port") {
+            generatorOptions.portPerTrack = false;
+        }
+        else if (arg == "--generate-from" && i + 1 < argc) {
+            generatorUri = argv[++i];
+        }
+        else if (arg == "--targets" && i + 1 < argc) {
+            generatorOptions.targets = static_cast<uint16_t>(PatternSeeker(argv[++i]).takeUInt64(0));
+        }
+        else if (arg == "--metadata-rate" && i + 1 < argc) {
+            generatorOptions.metadataRate = std::strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--seed" && i + 1 < argc) {
+            generatorOptions.seed = PatternSeeker(argv[++i]).takeUInt64(1);
+        }
+        else if (arg == "--dump-dir" && i + 1 < argc) {
+            catalogOptions.dumpDirectory = argv[++i];
+        }
+        else if (arg == "--bundle" && i + 1 < argc) {
+            bundlePath = argv[++i];
+        }
+        else if (arg == "--watch" && i + 1 < argc) {
+            watchInterval = std::chrono::seconds{ PatternSeeker(argv[++i]).takeUInt64(0) };
+        }
+        else if (arg == "--fan-out" && i + 1 < argc) {
+            fanOuts.push_back(argv[++i]);
+        }
+        else if (arg == "--query" && i + 1 < argc) {
+            detectionQuery = argv[++i];
+        }
+        else if (arg == "--extract-video" && i + 1 < argc) {
+            videoPath = argv[++i];
+        }
+        else if (arg == "--rtp-series" && i + 1 < argc) {
+            rtpSeriesPath = argv[++i];
+        }
+        else if (arg == "--inline-body-limit" && i + 1 < argc) {
+            catalogOptions.inlineBodyLimit = PatternSeeker(argv[++i]).takeUInt64(catalogOptions.inlineBodyLimit);
+        }
         else {
-            payload.back().append(data.substr(0, await_data_size));
-            await_data_size = 0;
-            std::cout << "no " << data.size() << "\n";
+            inputPath = arg;
         }
     }
 
-    stream.m_payload = payload;
+    auto data = loadData(inputPath, catalogOptions, bundlePath);
+    if (auto&& sharing = data.httpRequests->sharing(); sharing.items > 0) {
+        std::cout << fmt::format("HTTP exchanges: {} requests, heads and bodies, {} unique, {} -> {} bytes ({:.1f}x)\n", sharing.items,
+            sharing.unique, sharing.bytes, sharing.uniqueBytes, sharing.ratio());
+    }
+    if (auto&& sharing = data.rtspStreams->sharing; sharing.items > 0) {
+        std::cout << fmt::format("RTSP responses: {}, {} unique, {} -> {} bytes ({:.1f}x)\n", sharing.items, sharing.unique,
+            sharing.bytes, sharing.uniqueBytes, sharing.ratio());
+    }
+    for (auto&& spec : fanOuts) {
+        if (!data.rtspStreams->addFanOut(spec)) {
+            std::cerr << "Bad --fan-out " << spec << ", expected /prefix{first..last}[=/recorded/uri]\n";
+            return EXIT_FAILURE;
+        }
+    }
+    if (serve) {
+        live_snapshot_t live{ std::make_shared<const Snapshot>(Snapshot{ data, buildDetections(*data.rtspStreams) }) };
+        // the capture is parsed again on the watcher's thread, the serving threads only see the pointer swap
+        std::optional<CaptureWatcher> watcher;
+        if (watchInterval.count() > 0) {
+            watcher.emplace(inputPath, watchInterval, [&, generation = 0]() mutable {
+                auto options = catalogOptions;
+                // sessions of the old snapshot still send from its body store;
+                // the file of a reloaded one goes away with the last session that uses it
+                if (!options.bodyStorePath.empty()) {
+                    options.bodyStorePath += fmt::format(".{}", ++generation);
+                    options.isBodyStoreTemporary = true;
+                }
+                try {
+                    auto next = loadData(inputPath, options, bundlePath);
+                    if (next.httpRequests->size() == 0 && next.rtspStreams->streams.empty()) {
+                        std::cout << "Nothing to serve in " << inputPath << ", keeping the current capture\n";
+                        return;
+                    }
+                    for (auto&& spec : fanOuts) {
+                        next.rtspStreams->addFanOut(spec);
+                    }
+                    auto detections = buildDetections(*next.rtspStreams);
+                    std::cout << fmt::format("Reloaded {}: {} HTTP exchanges, {} RTSP streams\n", inputPath, next.httpRequests->size(),
+                        next.rtspStreams->streams.size());
+                    live.store(std::make_shared<const Snapshot>(Snapshot{ std::move(next), std::move(detections) }), std::memory_order_release);
+                }
+                catch (const std::exception& e) {
+                    std::cout << "Can't reload " << inputPath << ": " << e.what() << '\n';
+                }
+            });
+        }
+        return runServers(live, threads, httpLimits);
+    }
+    if (generate) {
+        auto& streams = data.rtspStreams->streams;
+        auto it = generatorUri.empty() ? streams.begin() : streams.find(generatorUri);
+        if (it == streams.end()) {
+            std::cerr << "There's no stream " << generatorUri << " to use as the template\n";
+            return EXIT_FAILURE;
+        }
+        return runGenerator(it->second, generatorOptions, generatorTarget, generatorSdpDirectory, threads);
+    }
+    // The store is decoded from the loaded catalog: with --bundle that's the mapped bundle and the capture isn't parsed,
+    // otherwise every run parses it. Under --serve it's built once for all the HTTP queries.
+    if (detectionQuery) {
+        if (bundlePath.empty())
+            std::cerr << "Parsed " << inputPath << " for one query, --bundle <file> skips that on the next runs\n";
+        std::string error;
+        auto query = DetectionStore::Query::parse(*detectionQuery, error);
+        if (!query) {
+            std::cerr << error << '\n';
+            return EXIT_FAILURE;
+        }
+        auto detections = buildDetections(*data.rtspStreams);
+        detections->writeCsv(std::cout, query->kind, detections->find(*query));
+        return 0;
+    }
+
+    auto& [httpRequests, rtspStreams] = data;
+    if (rtspStreams->streams.empty()) {
+        std::cout << "There are no RTSP streams in " << inputPath << '\n';
+        return 0;
+    }
+    analyzeRtp(*rtspStreams, rtpSeriesPath);
+    analyzeVideo(*rtspStreams, videoPath);
+
+    auto& stream = rtspStreams->streams.begin()->second;
+    auto& store = stream.m_packets;
+
+    std::vector<std::string_view> rtpPackets;
+    rtpPackets.reserve(store.size());
+    for (auto&& packet : store.packets()) {
+        if (PacketStore::isRtp(packet.channel))
+            rtpPackets.push_back(store.data(packet));
+    }
+
+    auto headers = rtp::decodeHeaders(rtpPackets);
+    std::cout << "RTP packets: " << headers.size() << ", not RTP: " << rtpPackets.size() - headers.size() << '\n';
+
+    for (auto&& [uri, recorded] : rtspStreams->streams) {
+        auto metadata = Raysharp::decodeStream(recorded.m_packets);
+        const auto& targets = metadata.targets();
+        const auto& rules = metadata.rules();
+        if (targets.size() == 0 && rules.size() == 0 && metadata.malformed() == 0)
+            continue;
+        std::cout << fmt::format("{}: {} targets, {} rules, {} malformed and {} unknown metadata payloads\n",
+            uri, targets.size(), rules.size(), metadata.malformed(), metadata.unknown());
+    }
 
     /*std::ofstream file(R"(C:\Users\irahm\Desktop\output_as_is.txt)", std::ios::out | std::ios::binary);
     for (pcpp::Packet packet : generatePackets(inputPath)) {
@@ -421,19 +1097,5 @@ int main(int argc, char* argv[]) {
         }
     }*/
 
-    // try {
-    //     net::io_context ioc{ 1 };
-    //     net::signal_set signals(ioc, SIGINT, SIGTERM);
-    //     signals.async_wait([&ioc](auto, auto) { ioc.stop(); });
-        
-    //     net::co_spawn(ioc, http_listener({ tcp::v4(), 80 }, httpRequests), net::detached);
-    //     net::co_spawn(ioc, rtsp_listener({ tcp::v4(), 554 }, rtspStreams), net::detached);
-    //     ioc.run();
-    // }
-    // catch (std::exception& e) {
-    //     std::cerr << "Error: " << e.what() << std::endl;
-    //     return EXIT_FAILURE;
-    // }
-        
     return 0;
 }
\ No newline at end of file